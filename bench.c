@@ -0,0 +1,635 @@
+/*  bench.c - how fast can a process take records from char_dev?
+ *
+ *  Load the module in record mode (insmod chardev.ko mode=record),
+ *  and this process forks a writer, which puts records into the
+ *  device as fast as it can, and takes them out again - first with
+ *  read, then with epoll and read, then waiting on a doorbell
+ *  eventfd rung every 1, 4, 16 and so on up to 1024 records, and
+ *  then with io_uring, with 1, 2, 4 and so on up to 256 reads in
+ *  flight at once.
+ *
+ *  There's no liburing here, so we talk to io_uring the hard way -
+ *  with its three system calls, and the rings it shares with us.
+ *
+ *  bench mmap maps the device's ring instead, and reads all of it,
+ *  in order and at random places, next to memory of our own made of
+ *  small pages and of huge ones. Load the module with hugepages=1 and
+ *  without, and compare - it counts the TLB misses too, if perf
+ *  events let it.
+ */
+
+/* device specifics, such as ioctl numbers and the
+ * major device file. */
+#include "chardev.h"
+
+
+#include <stdio.h>      /* printf */
+#include <stdlib.h>     /* exit, atoi, malloc */
+#include <string.h>     /* memset, memcpy */
+#include <errno.h>      /* errno */
+#include <fcntl.h>      /* open */
+#include <unistd.h>     /* close, read, fork */
+#include <time.h>       /* clock_gettime */
+#include <sys/epoll.h>  /* epoll */
+#include <sys/mman.h>   /* mmap, for the io_uring rings */
+#include <sys/uio.h>    /* writev */
+#include <sys/wait.h>   /* waitpid */
+#include <sys/ioctl.h>  /* ioctl */
+#include <sys/eventfd.h> /* eventfd, for the doorbell */
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+
+
+
+/* How much each read asks for */
+#define READ_SIZE 16384
+
+/* How many records the writer hands over in one writev */
+#define BATCH 64
+
+/* The most reads io_uring has in flight */
+#define MAX_DEPTH 256
+
+/* The most records a doorbell waits for, and how long
+ * it waits for the last few */
+#define MAX_WATERMARK 1024
+#define DOORBELL_TIMEOUT_US 1000
+
+
+static int Records = 100000;     /* in each run */
+static int Record_Size = 64;     /* bytes, without the header */
+
+/* System calls the reader made in this run */
+static long Syscalls;
+
+
+
+/* Helpers ***************************************** */
+
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int open_device(int flags)
+{
+  int file_desc;
+
+  file_desc = open(DEVICE_FILE_NAME, flags);
+  if (file_desc < 0) {
+    printf ("Can't open device file: %s\n",
+            DEVICE_FILE_NAME);
+    exit(-1);
+  }
+
+  return file_desc;
+}
+
+
+/* How many records a read got. Each starts with a
+ * struct char_dev_record, saying how long it is. */
+static int count_records(char *buf, ssize_t len)
+{
+  struct char_dev_record hdr;
+  ssize_t off = 0;
+  int records = 0;
+
+  while (off < len) {
+    memcpy(&hdr, buf + off, sizeof(hdr));
+    off += sizeof(hdr) + hdr.length;
+    records++;
+  }
+
+  return records;
+}
+
+
+/* Fork a process which writes Records records to the
+ * device, BATCH at a time, and exits. The device makes
+ * it wait when the ring is full. */
+static pid_t start_writer(void)
+{
+  struct iovec iov[BATCH];
+  char *record;
+  int file_desc, i, sent;
+  ssize_t ret;
+  pid_t pid;
+
+  pid = fork();
+  if (pid < 0) {
+    printf ("fork failed\n");
+    exit(-1);
+  }
+  if (pid > 0)
+    return pid;
+
+  file_desc = open_device(O_WRONLY);
+  record = malloc(Record_Size);
+  memset(record, 'x', Record_Size);
+  for (i = 0; i < BATCH; i++) {
+    iov[i].iov_base = record;
+    iov[i].iov_len = Record_Size;
+  }
+
+  /* A writev may take only some of the records - the
+   * count tells us how many */
+  for (sent = 0; sent < Records; sent += ret / Record_Size) {
+    i = Records - sent < BATCH ? Records - sent : BATCH;
+    ret = writev(file_desc, iov, i);
+    if (ret <= 0) {
+      printf ("writev failed:%d\n", errno);
+      exit(-1);
+    }
+  }
+
+  close(file_desc);
+  exit(0);
+}
+
+
+static void report(char *method, int depth, double start)
+{
+  double secs = now() - start;
+
+  printf ("%-8s %4d %10.0f records/s %8.1f MB/s "
+          "%6.3f syscalls/record\n",
+          method, depth, Records / secs,
+          Records * (double) Record_Size / secs / 1e6,
+          (double) Syscalls / Records);
+}
+
+
+
+/* read ******************************************** */
+
+
+/* A plain blocking read - the device puts us to sleep
+ * until there are records */
+static void bench_read(void)
+{
+  static char buf[READ_SIZE];
+  int file_desc, got = 0;
+  double start;
+  pid_t pid;
+  ssize_t ret;
+
+  file_desc = open_device(O_RDONLY);
+  Syscalls = 0;
+  start = now();
+  pid = start_writer();
+
+  while (got < Records) {
+    ret = read(file_desc, buf, READ_SIZE);
+    Syscalls++;
+    if (ret < 0) {
+      printf ("read failed:%d\n", errno);
+      exit(-1);
+    }
+    got += count_records(buf, ret);
+  }
+
+  waitpid(pid, NULL, 0);
+  report("read", 1, start);
+  close(file_desc);
+}
+
+
+
+/* epoll ******************************************* */
+
+
+/* epoll_wait until the device is readable, then read
+ * until it says -EAGAIN */
+static void bench_epoll(void)
+{
+  static char buf[READ_SIZE];
+  struct epoll_event ev;
+  int file_desc, epfd, got = 0;
+  double start;
+  pid_t pid;
+  ssize_t ret;
+
+  file_desc = open_device(O_RDONLY | O_NONBLOCK);
+  epfd = epoll_create1(0);
+  ev.events = EPOLLIN;
+  ev.data.fd = file_desc;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, file_desc, &ev) < 0) {
+    printf ("epoll_ctl failed:%d\n", errno);
+    exit(-1);
+  }
+
+  Syscalls = 0;
+  start = now();
+  pid = start_writer();
+
+  while (got < Records) {
+    epoll_wait(epfd, &ev, 1, -1);
+    Syscalls++;
+
+    for (;;) {
+      ret = read(file_desc, buf, READ_SIZE);
+      Syscalls++;
+      if (ret < 0 && errno == EAGAIN)
+        break;
+      if (ret < 0) {
+        printf ("read failed:%d\n", errno);
+        exit(-1);
+      }
+      got += count_records(buf, ret);
+    }
+  }
+
+  waitpid(pid, NULL, 0);
+  report("epoll", 1, start);
+  close(epfd);
+  close(file_desc);
+}
+
+
+
+/* Doorbell **************************************** */
+
+
+/* Wait on an eventfd the device signals once
+ * watermark records came, then read until it says
+ * -EAGAIN. The timeout picks up the last few. */
+static void bench_doorbell(int watermark)
+{
+  static char buf[READ_SIZE];
+  struct char_dev_doorbell doorbell;
+  int file_desc, efd, got = 0;
+  uint64_t rings;
+  double start;
+  pid_t pid;
+  ssize_t ret;
+
+  file_desc = open_device(O_RDONLY | O_NONBLOCK);
+  efd = eventfd(0, 0);
+  doorbell.fd = efd;
+  doorbell.bytes = 0;
+  doorbell.records = watermark;
+  doorbell.timeout_us = DOORBELL_TIMEOUT_US;
+  if (ioctl(file_desc, IOCTL_SET_DOORBELL, &doorbell) < 0) {
+    printf ("IOCTL_SET_DOORBELL failed:%d\n", errno);
+    exit(-1);
+  }
+
+  Syscalls = 0;
+  start = now();
+  pid = start_writer();
+
+  while (got < Records) {
+    read(efd, &rings, sizeof(rings));
+    Syscalls++;
+
+    for (;;) {
+      ret = read(file_desc, buf, READ_SIZE);
+      Syscalls++;
+      if (ret < 0 && errno == EAGAIN)
+        break;
+      if (ret < 0) {
+        printf ("read failed:%d\n", errno);
+        exit(-1);
+      }
+      got += count_records(buf, ret);
+    }
+  }
+
+  waitpid(pid, NULL, 0);
+  report("doorbell", watermark, start);
+  close(file_desc);
+  close(efd);
+}
+
+
+
+/* io_uring **************************************** */
+
+
+/* Our side of an io_uring - the submission queue we
+ * put reads on, and the completion queue the kernel
+ * puts the results on. Both are shared with the
+ * kernel, which is why the indexes are read and
+ * written with the __atomic builtins. */
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+};
+
+
+static void uring_setup(struct uring *ring, unsigned entries)
+{
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) {
+    printf ("io_uring_setup failed:%d\n", errno);
+    exit(-1);
+  }
+
+  sq = mmap(NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_SQ_RING);
+  cq = mmap(NULL, p.cq_off.cqes +
+                  p.cq_entries * sizeof(struct io_uring_cqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    printf ("mmap of io_uring failed:%d\n", errno);
+    exit(-1);
+  }
+
+  ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+}
+
+
+/* Put a read of buffer slot on the submission queue.
+ * The kernel sees it once we've called io_uring_enter. */
+static void uring_read(struct uring *ring, int file_desc,
+                       char *buf, unsigned slot)
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = file_desc;
+  sqe->addr = (unsigned long) buf;
+  sqe->len = READ_SIZE;
+  sqe->off = -1;          /* wherever the file is */
+  sqe->user_data = slot;
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Keep depth reads in flight. io_uring tries each one
+ * right away; if the device says -EAGAIN it waits for
+ * poll to say there are records, and tries again -
+ * without a thread of its own for each read. */
+static void bench_uring(int depth)
+{
+  struct uring ring;
+  struct io_uring_cqe *cqe;
+  char *bufs;
+  int file_desc, got = 0, i, submit;
+  unsigned head;
+  double start;
+  pid_t pid;
+
+  file_desc = open_device(O_RDONLY);
+  uring_setup(&ring, depth);
+  bufs = malloc((size_t) depth * READ_SIZE);
+
+  Syscalls = 0;
+  start = now();
+  pid = start_writer();
+
+  for (i = 0; i < depth; i++)
+    uring_read(&ring, file_desc, bufs + (size_t) i * READ_SIZE, i);
+  submit = depth;
+
+  while (got < Records) {
+    /* Submit the reads we queued, and wait for at
+     * least one to complete - one system call */
+    if (syscall(__NR_io_uring_enter, ring.fd, submit, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+        errno != EINTR) {
+      printf ("io_uring_enter failed:%d\n", errno);
+      exit(-1);
+    }
+    Syscalls++;
+    submit = 0;
+
+    /* Take whatever has completed, and put each
+     * buffer back on the queue */
+    head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring.cqes[head & *ring.cq_mask];
+      if (cqe->res < 0) {
+        printf ("io_uring read failed:%d\n", -cqe->res);
+        exit(-1);
+      }
+      got += count_records(bufs + cqe->user_data * READ_SIZE,
+                           cqe->res);
+      uring_read(&ring, file_desc,
+                 bufs + cqe->user_data * READ_SIZE,
+                 cqe->user_data);
+      submit++;
+      head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  waitpid(pid, NULL, 0);
+  report("io_uring", depth, start);
+
+  /* Closing the ring cancels the reads still waiting */
+  close(ring.fd);
+  close(file_desc);
+  free(bufs);
+}
+
+
+
+/* mmap ******************************************** */
+
+
+/* A counter of this process' data TLB misses, or -1 if
+ * perf events aren't allowed */
+static int tlb_counter(void)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+static long long tlb_misses(int counter)
+{
+  long long misses;
+
+  if (counter < 0 ||
+      read(counter, &misses, sizeof(misses)) != sizeof(misses))
+    return -1;
+  return misses;
+}
+
+
+/* Read buf - a byte of each cache line, in order, and
+ * then as many at random places - and say how fast it
+ * was, and how many TLB misses it took */
+static void scan(char *what, volatile char *buf, size_t size,
+                 int counter)
+{
+  unsigned long long x = 88172645463325252ULL;
+  size_t lines = size / 64, i;
+  long long misses;
+  double start, secs;
+  char sum = 0;
+
+  misses = tlb_misses(counter);
+  start = now();
+  for (i = 0; i < lines; i++)
+    sum += buf[i * 64];
+  secs = now() - start;
+  printf ("%-14s in order  %8.1f MB/s", what,
+          size / secs / 1e6);
+  if (misses >= 0)
+    printf (" %8.3f TLB misses/KB",
+            (tlb_misses(counter) - misses) * 1024.0 / size);
+  printf ("\n");
+
+  misses = tlb_misses(counter);
+  start = now();
+  for (i = 0; i < lines; i++) {
+    /* xorshift - cheap, and random enough */
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    sum += buf[(x % lines) * 64];
+  }
+  secs = now() - start;
+  printf ("%-14s at random %8.1f M reads/s", what,
+          lines / secs / 1e6);
+  if (misses >= 0)
+    printf (" %6.3f TLB misses/read",
+            (double) (tlb_misses(counter) - misses) / lines);
+  printf ("\n");
+
+  /* So the compiler doesn't leave the reads out */
+  if (sum == 42)
+    printf (" ");
+}
+
+
+/* Our own memory of size bytes, with the pages advice
+ * says, filled so it's all there before we scan it */
+static char *own_memory(size_t size, int advice)
+{
+  char *buf;
+
+  buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    printf ("mmap of %zu bytes failed:%d\n", size, errno);
+    exit(-1);
+  }
+  madvise(buf, size, advice);
+  memset(buf, 1, size);
+
+  return buf;
+}
+
+
+static void bench_mmap(void)
+{
+  struct char_dev_ring ring;
+  int file_desc, counter;
+  char *buf;
+
+  file_desc = open_device(O_RDONLY);
+  if (ioctl(file_desc, IOCTL_GET_RING, &ring) < 0) {
+    printf ("ioctl_get_ring failed:%d - is the device "
+            "in record or fanout mode?\n", errno);
+    exit(-1);
+  }
+
+  buf = mmap(NULL, ring.size, PROT_READ, MAP_SHARED,
+             file_desc, 0);
+  if (buf == MAP_FAILED) {
+    printf ("mmap of the ring failed:%d\n", errno);
+    exit(-1);
+  }
+
+  counter = tlb_counter();
+  printf ("ring of %u bytes, %s pages%s\n", ring.size,
+          ring.huge ? "huge" : "small",
+          counter < 0 ? " (no TLB counter)" : "");
+
+  /* The first time round maps the pages */
+  scan("char_dev", buf, ring.size, -1);
+  scan("char_dev", buf, ring.size, counter);
+  munmap(buf, ring.size);
+
+  buf = own_memory(ring.size, MADV_NOHUGEPAGE);
+  scan("small pages", buf, ring.size, counter);
+  munmap(buf, ring.size);
+
+  buf = own_memory(ring.size, MADV_HUGEPAGE);
+  scan("huge pages", buf, ring.size, counter);
+  munmap(buf, ring.size);
+
+  close(file_desc);
+}
+
+
+
+/* Main - run the lot ****************************** */
+
+
+int main(int argc, char *argv[])
+{
+  int depth;
+
+  if (argc > 1 && strcmp(argv[1], "mmap") == 0) {
+    bench_mmap();
+    return 0;
+  }
+
+  if (argc > 1)
+    Records = atoi(argv[1]);
+  if (argc > 2)
+    Record_Size = atoi(argv[2]);
+
+  if (Records <= 0 || Record_Size <= 0 ||
+      Record_Size + sizeof(struct char_dev_record) > READ_SIZE) {
+    printf ("Usage: %s [records] [record size]\n"
+            "       %s mmap\n", argv[0], argv[0]);
+    exit(-1);
+  }
+
+  printf ("%d records of %d bytes\n", Records, Record_Size);
+
+  bench_read();
+  bench_epoll();
+  for (depth = 1; depth <= MAX_WATERMARK; depth *= 4)
+    bench_doorbell(depth);
+  for (depth = 1; depth <= MAX_DEPTH; depth *= 2)
+    bench_uring(depth);
+
+  return 0;
+}
@@ -5,39 +5,62 @@
 #include <linux/kernel.h>   /* We're doing kernel work */
 #include <linux/module.h>   /* Specifically, a module */
 
-/* Deal with CONFIG_MODVERSIONS */
-#if CONFIG_MODVERSIONS==1
-#define MODVERSIONS
-#include <linux/modversions.h>
-#endif        
-
 /* For character devices */
 
 /* The character device definitions are here */
 #include <linux/fs.h>
 
-/* A wrapper which does next to nothing at
- * at present, but may help for compatibility
- * with future versions of Linux */
-#include <linux/wrapper.h>
+/* For copy_to_user, copy_from_user and friends */
+#include <linux/uaccess.h>
+
+/* For the iterators read_iter and write_iter get, and
+ * splice, which uses them */
+#include <linux/uio.h>
+#include <linux/splice.h>
+
+/* For Device_Open */
+#include <linux/atomic.h>
+
+/* For record mode - the ring, the locks around it and
+ * the module parameters which choose it */
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+
+/* For waiting for records, or for room for them, and
+ * for telling poll, epoll and io_uring when to stop */
+#include <linux/wait.h>
+#include <linux/poll.h>
+
+/* For fan-out mode - each reader's place in the ring */
+#include <linux/slab.h>
+#include <linux/seqlock.h>
+
+/* For the counters, and the /proc file they're in, and
+ * for putting the rings on the right NUMA node */
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/topology.h>
+#include <linux/nodemask.h>
+
+/* For doorbells - an eventfd, rung when enough has
+ * been written, or it's been long enough */
+#include <linux/eventfd.h>
+#include <linux/hrtimer.h>
+#include <linux/list.h>
+
+/* What changed between the kernels we build for */
+#include "compat.h"
 
-			     
 /* Our own ioctl numbers */
 #include "chardev.h"
 
-
-/* In 2.2.3 /usr/include/linux/version.h includes a 
- * macro for this, but 2.0.35 doesn't - so I add it 
- * here if necessary. */
-#ifndef KERNEL_VERSION
-#define KERNEL_VERSION(a,b,c) ((a)*65536+(b)*256+(c))
-#endif
-
-
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-#include <asm/uaccess.h>  /* for get_user and put_user */
-#endif
+MODULE_LICENSE("GPL");
 
 
 
@@ -47,7 +70,7 @@
 /* Device Declarations ******************************** */
 
 
-/* The name for our device, as it will appear in 
+/* The name for our device, as it will appear in
  * /proc/devices */
 #define DEVICE_NAME "char_dev"
 
@@ -55,305 +78,2048 @@
 /* The maximum length of the message for the device */
 #define BUF_LEN 80
 
-/* Is the device open right now? Used to prevent 
+/* Is the device open right now? Used to prevent
  * concurent access into the same device */
-static int Device_Open = 0;
+static atomic_t Device_Open = ATOMIC_INIT(0);
 
-/* The message the device will give when asked */
+/* The message the device will give when asked, and
+ * how long it is.
+ *
+ * We used to keep Message_Ptr, how far the process
+ * reading the message got. Now the device is like a
+ * small file: the file's position says how far, and
+ * lseek, pread and pwrite can get at any part of the
+ * message with one bounds-checked copy. */
 static char Message[BUF_LEN];
+static size_t Message_Len;
+
+
+
+/* Record mode ************************************ */
+
+
+/* In message mode (the default) the device holds one
+ * message - a write replaces it, a read gets it, and
+ * anything longer than BUF_LEN is cut. There's no way
+ * to pass more than one message at a time.
+ *
+ * In record mode (insmod chardev.ko mode=record), the
+ * device is a queue of records, held in a ring of
+ * ring_size bytes. Each write adds one record - or,
+ * with writev, one for each iovec - and records may
+ * hold anything, zeros included. A read gets as many
+ * whole records as fit, each with a struct
+ * char_dev_record in front saying how long it is
+ * (see chardev.h). readv puts one record at the start
+ * of each iovec. So a producer can hand us a thousand
+ * records in one writev, and a consumer take them in
+ * one readv, where it used to take a system call for
+ * each.
+ *
+ * In record mode several processes may have the device
+ * open - one writing and one reading, say. A reader
+ * waits for records when there are none, and a writer
+ * for room when the ring is full - unless the device
+ * was opened with O_NONBLOCK, or the kernel asked us
+ * not to wait (see nonblocking below), in which case
+ * they fail with -EAGAIN.
+ *
+ * In fan-out mode (mode=fanout), the records are the
+ * same, but reading doesn't take them out of the ring.
+ * Every open of the device gets each record written
+ * after it, with a cursor of its own - so one writer
+ * can talk to dozens of readers, and the record is in
+ * memory once. The writer never waits for a reader:
+ * when the ring is full it overwrites the oldest
+ * record. A reader which was too slow finds that the
+ * next read fails with -EPIPE (as /dev/kmsg does),
+ * and the one after it goes on from the oldest record
+ * left. IOCTL_GET_OVERRUN tells it how many records it
+ * missed.
+ *
+ * What a writer does when the ring is full is its
+ * policy (see chardev.h) - block until there's room,
+ * fail with -EAGAIN, drop the record it's writing, or
+ * overwrite the oldest ones. The policy parameter sets
+ * it for the device, and IOCTL_SET_POLICY for one open
+ * file. A fan-out writer never waits for its readers,
+ * and they never take records out of the ring, so
+ * only overwriting makes room there - that's the one
+ * policy fan-out mode has. How much each
+ * policy cost - time blocked, bytes dropped - is in
+ * /proc/char_dev.
+ *
+ * In both modes, a process may also mmap the ring and
+ * read the records where they are, and other modules
+ * may write records too, with char_dev_reserve and
+ * friends (see chardev.h) - from interrupt handlers,
+ * even, since those never sleep. */
+static char *mode = "message";
+module_param(mode, charp, 0444);
+
+static char *policy;
+module_param(policy, charp, 0444);
+
+static unsigned int ring_size = 65536;
+module_param(ring_size, uint, 0444);
+
+#define MODE_MESSAGE 0
+#define MODE_RECORD  1
+#define MODE_FANOUT  2
+static int Mode = MODE_MESSAGE;
+
+
+/* The ring holds the records back to back, each after
+ * its header. The indices run freely, only the offsets
+ * they map to wrap around - so a record, or even its
+ * header, may start at the end of the ring and go on
+ * at its beginning.
+ *
+ * reserve - advanced by a writer, for each record it
+ *           starts to write
+ * head    - advanced past each record once it's been
+ *           written, so readers never see one half
+ *           done
+ * tail    - advanced by the reader, for each record
+ *           (by the writer, in fan-out mode)
+ *
+ * Processes writing take turns on write_lock, and
+ * readers on read_lock, so there's only one of each at
+ * a time - and like the rings in syscall.c, that means
+ * the tail needs no lock of its own. But other modules
+ * write too (see char_dev_reserve), from places where
+ * they can't sleep, so reserve and head move under
+ * produce_lock, a spin lock. A writer holds it to
+ * reserve room for a record, and again to commit it
+ * when it's written - not in between, so a process can
+ * take a page fault while it fills its record in.
+ *
+ * head_seq and tail_seq number the records - the next
+ * one to be written, and the oldest one still in the
+ * ring. Only fan-out mode looks at them. tail_seq and
+ * tail change together, under tail_lock, so a reader
+ * can take both without stopping the writer.
+ *
+ * Readers sleep on read_wq until there are records,
+ * and writers on write_wq until there's room. poll
+ * puts its callers on them as well. Files which would
+ * rather hear about records on an eventfd have a
+ * doorbell on doorbells (see doorbell_set). */
+struct ring {
+  char *data;
+  struct page **pages;  /* data's pages, if they're huge */
+  int node;             /* The NUMA node data is on */
+  unsigned int reserve, head, tail;
+  spinlock_t produce_lock;
+  struct mutex write_lock;
+  struct mutex read_lock;
+  u64 head_seq, tail_seq;
+  seqlock_t tail_lock;
+  wait_queue_head_t read_wq;
+  wait_queue_head_t write_wq;
+  spinlock_t doorbell_lock;
+  struct list_head doorbells;
+};
+
+/* Usually there's one ring, in Rings[0]. With
+ * per_node=1 there's one on each node with memory, in
+ * Rings[node], and each open file uses the one on its
+ * opener's node - so a writer and a reader on the same
+ * node never reach across to another node's memory,
+ * but a record written on one node is only read there.
+ *
+ * The ring goes on the node given by the node
+ * parameter. If there isn't one, it goes on the node
+ * of the first process to open the device - that's
+ * what Alloc_Lock is for. */
+static struct ring *Rings[MAX_NUMNODES];
+static DEFINE_MUTEX(Alloc_Lock);
+
+static int node = NUMA_NO_NODE;
+module_param(node, int, 0444);
+
+static bool per_node;
+module_param(per_node, bool, 0444);
+
+/* With hugepages=1, a ring is made of huge pages (2MB,
+ * on x86), if the ring is at least that big and there
+ * are any to be had. A process which maps the ring
+ * reaches each with one TLB entry (see device_mmap).
+ * The kernel only does if the ring is exactly one huge
+ * page, which it uses through the linear map; a bigger
+ * ring is stitched together with vmap, and that maps
+ * it with small pages. If there aren't any, the ring
+ * is made of ordinary pages, as it would be without
+ * the parameter. /proc/char_dev says which it got. */
+static bool hugepages;
+module_param(hugepages, bool, 0444);
+
+#define HUGE_ORDER (PMD_SHIFT - PAGE_SHIFT)
+#define HUGE_PAGES (1UL << HUGE_ORDER)
+
+/* How many pages processes which mapped a ring got
+ * with each fault, for /proc/char_dev */
+static atomic64_t Huge_Faults = ATOMIC64_INIT(0);
+static atomic64_t Small_Faults = ATOMIC64_INIT(0);
+
+/* How often a file read or wrote a ring on its own
+ * node, and on another one, for /proc/char_dev. Each
+ * CPU counts its own, like intrpt.c does, so counting
+ * doesn't bounce a cache line between the nodes. */
+struct numa_stats {
+  u64 local, remote;
+};
+static DEFINE_PER_CPU(struct numa_stats, Numa_Stats);
+
+/* What we keep for each open of the device in record
+ * and fan-out modes, in the file's private_data - its
+ * policy, and where a fan-out reader is. The lock keeps
+ * threads sharing the file from reading the same
+ * records. */
+struct ring_file {
+  int policy;        /* CHAR_DEV_POLICY_... */
+  struct mutex lock;
+  unsigned int pos;  /* The index of its next record */
+  u64 seq;           /* and that record's number */
+  u64 overrun;       /* Records it missed, for the ioctl */
+  struct ring *ring; /* The ring the file uses */
+  struct doorbell *doorbell;  /* If it asked for one */
+};
+
+/* A doorbell is an eventfd we signal for a file when
+ * records were written to its ring - not for each one,
+ * but once there are enough of them (records) or
+ * enough bytes in them (bytes), or timeout after the
+ * first of them, whichever comes first. A process can
+ * give the same eventfd to many files, and wait for
+ * all of them with one read. new_bytes and
+ * new_records count what came since it last rang.
+ * All of it is under the ring's doorbell_lock. */
+struct doorbell {
+  struct list_head list;  /* In the ring's doorbells */
+  struct eventfd_ctx *ctx;
+  u32 bytes, records;     /* 0 - don't count these */
+  ktime_t timeout;        /* 0 - no timeout */
+  u64 new_bytes, new_records;
+  struct hrtimer timer;
+  struct ring *ring;
+};
+
+/* How many records writers told doorbells about, and
+ * how many times they rang for them - how much the
+ * watermarks saved - for /proc/char_dev */
+static atomic64_t Doorbell_Records = ATOMIC64_INIT(0);
+static atomic64_t Doorbell_Rings = ATOMIC64_INIT(0);
+static atomic64_t Doorbell_Timeouts = ATOMIC64_INIT(0);
+
+/* The policy new files get */
+static int Policy = CHAR_DEV_POLICY_BLOCK;
+
+static const char * const Policy_Names[CHAR_DEV_POLICIES] = {
+  [CHAR_DEV_POLICY_BLOCK] = "block",
+  [CHAR_DEV_POLICY_EAGAIN] = "eagain",
+  [CHAR_DEV_POLICY_DROP_NEWEST] = "drop",
+  [CHAR_DEV_POLICY_OVERWRITE] = "overwrite",
+};
+
+/* What each policy cost, for /proc/char_dev. Writers
+ * add to the ones of the policy of their file. */
+struct policy_stats {
+  atomic64_t records;     /* Records written */
+  atomic64_t blocked_ns;  /* Time spent waiting for room */
+  atomic64_t dropped;     /* Bytes thrown away */
+  atomic64_t refused;     /* Writes failed with -EAGAIN */
+};
+static struct policy_stats Stats[CHAR_DEV_POLICIES];
+
+
+/* Is p a policy this mode can have? A fan-out writer
+ * can't wait for all its readers, and if it dropped new
+ * records instead, once the ring was full it would
+ * drop every one - nothing else moves the tail. */
+static int policy_ok(unsigned long p)
+{
+  if (p >= CHAR_DEV_POLICIES)
+    return 0;
+
+  return Mode != MODE_FANOUT ||
+         p == CHAR_DEV_POLICY_OVERWRITE;
+}
+
+
+#define RING_OFFSET(i) ((i) & (ring_size - 1))
+#define RECORD_HDR sizeof(struct char_dev_record)
+
+/* In a record's length in the ring, while its writer
+ * is still filling it in. The head doesn't go past a
+ * busy record. */
+#define RECORD_BUSY (1U << 30)
+
+/* The length without the flags */
+#define RECORD_LENGTH(hdr) \
+  ((hdr).length & ~(RECORD_BUSY | CHAR_DEV_RECORD_DISCARD))
+
+/* The longest record there can be. It has to fit in
+ * the ring, and in a ring of a gigabyte or more, its
+ * length would run into the flags first. */
+#define RECORD_MAX \
+  min_t(size_t, ring_size - RECORD_HDR, RECORD_BUSY - 1)
+
+
+/* How many bytes of the ring are free */
+static inline unsigned int ring_free(struct ring *r)
+{
+  return ring_size - (r->reserve - READ_ONCE(r->tail));
+}
+
+
+/* Is there room in the ring for a record of len
+ * bytes? */
+static inline int ring_has_room(struct ring *r, size_t len)
+{
+  return r->reserve - READ_ONCE(r->tail) + RECORD_HDR +
+         len <= ring_size;
+}
+
+
+/* Make r's data out of huge pages on node nid, and
+ * map them together in the kernel with vmap - unless
+ * there's only one, whose linear map address is huge
+ * mapped already. r->pages has every small page of
+ * them, the way vmap and device_mmap want - each huge
+ * page starts at every HUGE_PAGES'th. We
+ * don't try hard: if the memory is too fragmented for
+ * a huge page, we'd rather have small pages now than
+ * wait for compaction. */
+static int ring_alloc_huge(struct ring *r, int nid)
+{
+  unsigned long nr = ring_size >> PAGE_SHIFT;
+  unsigned long i, j;
+  struct page *page;
+
+  r->pages = kvmalloc_node(nr * sizeof(*r->pages),
+                           GFP_KERNEL, nid);
+  if (r->pages == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < nr; i += HUGE_PAGES) {
+    page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO |
+                                 __GFP_COMP | __GFP_NOWARN |
+                                 __GFP_NORETRY,
+                            HUGE_ORDER);
+    if (page == NULL)
+      goto fail;
+    for (j = 0; j < HUGE_PAGES; j++)
+      r->pages[i + j] = page + j;
+  }
+
+  if (nr == HUGE_PAGES)
+    r->data = page_address(r->pages[0]);
+  else
+    r->data = vmap(r->pages, nr, VM_MAP, PAGE_KERNEL);
+  if (r->data != NULL)
+    return 0;
+
+fail:
+  while (i > 0) {
+    i -= HUGE_PAGES;
+    __free_pages(r->pages[i], HUGE_ORDER);
+  }
+  kvfree(r->pages);
+  r->pages = NULL;
+  return -ENOMEM;
+}
+
+
+/* Make a ring, with its data on node nid */
+static struct ring *ring_alloc(int nid)
+{
+  struct ring *r;
+
+  r = kzalloc_node(sizeof(*r), GFP_KERNEL, nid);
+  if (r == NULL)
+    return NULL;
+
+  /* Without huge pages, kvzalloc_node gives us
+   * physically contiguous pages if it can, and falls
+   * back to vmalloc if it can't. Zeroed, because
+   * processes may map the ring. */
+  if (!hugepages || ring_size < PMD_SIZE ||
+      ring_alloc_huge(r, nid) != 0)
+    r->data = kvzalloc_node(ring_size, GFP_KERNEL, nid);
+  if (r->data == NULL) {
+    kfree(r);
+    return NULL;
+  }
+
+  r->node = nid;
+  spin_lock_init(&r->produce_lock);
+  mutex_init(&r->write_lock);
+  spin_lock_init(&r->doorbell_lock);
+  INIT_LIST_HEAD(&r->doorbells);
+  mutex_init(&r->read_lock);
+  seqlock_init(&r->tail_lock);
+  init_waitqueue_head(&r->read_wq);
+  init_waitqueue_head(&r->write_wq);
+
+  return r;
+}
+
+
+/* Free all the rings there are */
+static void rings_free(void)
+{
+  int nid;
+
+  unsigned long i;
+  struct ring *r;
+
+  for (nid = 0; nid < MAX_NUMNODES; nid++) {
+    r = Rings[nid];
+    if (r == NULL)
+      continue;
+
+    if (r->pages) {
+      if (is_vmalloc_addr(r->data))
+        vunmap(r->data);
+      for (i = 0; i < ring_size >> PAGE_SHIFT; i += HUGE_PAGES)
+        __free_pages(r->pages[i], HUGE_ORDER);
+      kvfree(r->pages);
+    } else {
+      kvfree(r->data);
+    }
+
+    kfree(r);
+    Rings[nid] = NULL;
+  }
+}
+
+
+/* The ring for a file the current process opens - the
+ * one on its node with per_node, or else the one ring,
+ * which we make now on this process' node if nobody
+ * said where to put it and this is the first open.
+ * numa_mem_id is the nearest node with memory, in case
+ * ours has none. */
+static struct ring *open_ring(void)
+{
+  int nid = numa_mem_id();
+  struct ring *r;
+
+  if (per_node)
+    return Rings[nid] ? Rings[nid] : Rings[first_memory_node];
+
+  mutex_lock(&Alloc_Lock);
+  /* producer_ring looks without the lock - the ring
+   * has to be all there before it can see it */
+  if (Rings[0] == NULL)
+    smp_store_release(&Rings[0], ring_alloc(nid));
+  r = Rings[0];
+  mutex_unlock(&Alloc_Lock);
+
+  return r;
+}
+
+
+/* Make the rings we know where to put at load time -
+ * one on each node with memory with per_node, or the
+ * one on the node parameter's node */
+static int rings_init(void)
+{
+  int nid;
+
+  if (per_node) {
+    for_each_node_state(nid, N_MEMORY) {
+      Rings[nid] = ring_alloc(nid);
+      if (Rings[nid] == NULL) {
+        rings_free();
+        return -ENOMEM;
+      }
+    }
+  } else if (node != NUMA_NO_NODE) {
+    if (node < 0 || node >= MAX_NUMNODES ||
+        !node_state(node, N_MEMORY)) {
+      printk ("node %d has no memory\n", node);
+      return -EINVAL;
+    }
+    Rings[0] = ring_alloc(node);
+    if (Rings[0] == NULL)
+      return -ENOMEM;
+  }
+
+  return 0;
+}
+
+
+/* Count a read or write of r as local or remote */
+static inline void count_access(struct ring *r)
+{
+  if (r->node == numa_mem_id())
+    this_cpu_inc(Numa_Stats.local);
+  else
+    this_cpu_inc(Numa_Stats.remote);
+}
+
+
+/* May we wait? Not if the device was opened with
+ * O_NONBLOCK, and not if the kernel says IOCB_NOWAIT.
+ * That's what io_uring (and AIO) says first: it tries
+ * to do the read or write right away, in the process
+ * which asked for it. If we'd have to wait, we say
+ * -EAGAIN, and io_uring waits for poll to say we're
+ * ready (see device_poll) and tries again - without
+ * tying a thread up in the meantime. It only does that
+ * for files which have FMODE_NOWAIT, which device_open
+ * sets. */
+static inline int nonblocking(struct kiocb *iocb)
+{
+  return (iocb->ki_flags & IOCB_NOWAIT) ||
+         (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+
+/* Take one of the locks. Even that is waiting, as far
+ * as IOCB_NOWAIT is concerned. */
+static int record_lock(struct mutex *lock,
+                       struct kiocb *iocb)
+{
+  if (iocb->ki_flags & IOCB_NOWAIT)
+    return mutex_trylock(lock) ? 0 : -EAGAIN;
+
+  return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+
+/* Wake up whoever waits on wq for events. Only bother
+ * with the wait queue's lock if somebody is waiting -
+ * the barrier makes sure that a process which went to
+ * sleep just now either sees the new index, or is seen
+ * by waitqueue_active. */
+static void record_wake(wait_queue_head_t *wq,
+                        __poll_t events)
+{
+  smp_mb();
+  if (waitqueue_active(wq))
+    wake_up_interruptible_poll(wq, events);
+}
+
+
+/* Copy len bytes from buf into the ring, at index pos */
+static void ring_put(struct ring *r, unsigned int pos,
+                     const void *buf, size_t len)
+{
+  size_t first = ring_size - RING_OFFSET(pos);
+
+  if (first > len)
+    first = len;
+  memcpy(r->data + RING_OFFSET(pos), buf, first);
+  memcpy(r->data, buf + first, len - first);
+}
+
+
+/* Copy len bytes from the ring, at index pos, to buf */
+static void ring_get(struct ring *r, unsigned int pos,
+                     void *buf, size_t len)
+{
+  size_t first = ring_size - RING_OFFSET(pos);
+
+  if (first > len)
+    first = len;
+  memcpy(buf, r->data + RING_OFFSET(pos), first);
+  memcpy(buf + first, r->data, len - first);
+}
+
+
+/* The same, between the ring and an iterator. They
+ * return how much was copied, which is less than len
+ * only if the process gave us a bad buffer. */
+static size_t ring_copy_from_iter(struct ring *r,
+                                  unsigned int pos,
+                                  size_t len,
+                                  struct iov_iter *from)
+{
+  size_t first = ring_size - RING_OFFSET(pos);
+  size_t done;
+
+  if (first > len)
+    first = len;
+  done = copy_from_iter(r->data + RING_OFFSET(pos), first,
+                        from);
+  if (done < first)
+    return done;
+  return done + copy_from_iter(r->data, len - first, from);
+}
+
+
+static size_t ring_copy_to_iter(struct ring *r,
+                                unsigned int pos,
+                                size_t len,
+                                struct iov_iter *to)
+{
+  size_t first = ring_size - RING_OFFSET(pos);
+  size_t done;
+
+  if (first > len)
+    first = len;
+  done = copy_to_iter(r->data + RING_OFFSET(pos), first, to);
+  if (done < first)
+    return done;
+  return done + copy_to_iter(r->data, len - first, to);
+}
+
+
+/* How much of the iterator the next record goes to (or
+ * comes from) - the rest of the current iovec for
+ * readv and writev, all of it for anything else (read,
+ * write and splice). An empty iovec is skipped - an
+ * advance by nothing moves the iterator past it. */
+static size_t record_room(struct iov_iter *iter)
+{
+  unsigned long segs;
+
+  if (!iter_is_iovec(iter))
+    return iov_iter_count(iter);
+
+  for (segs = iter->nr_segs;
+       segs > 0 && iov_iter_count(iter) &&
+         iov_iter_single_seg_count(iter) == 0;
+       segs--)
+    iov_iter_advance(iter, 0);
+
+  return iov_iter_single_seg_count(iter);
+}
+
+
+/* Throw the oldest record away, and return its
+ * length. In fan-out mode, a reader which is copying
+ * it now sees tail_seq go past its record's number
+ * when it's done, and knows that what it copied may be
+ * half overwritten - the seqlock makes sure the new
+ * tail_seq is visible before the writer puts anything
+ * in the record's place. In record mode the reader
+ * moves the tail as well, so the writer has to hold
+ * read_lock (see ring_overwrite). */
+static size_t ring_drop_oldest(struct ring *r)
+{
+  struct char_dev_record hdr;
+
+  ring_get(r, r->tail, &hdr, RECORD_HDR);
+
+  write_seqlock(&r->tail_lock);
+  r->tail += RECORD_HDR + RECORD_LENGTH(hdr);
+  r->tail_seq++;
+  write_sequnlock(&r->tail_lock);
+
+  return RECORD_LENGTH(hdr);
+}
+
+
+/* Reserve room for a record of len bytes, and say in
+ * *pos where its header goes. Until ring_commit, the
+ * header says RECORD_BUSY. With overwrite, we make
+ * room by throwing the oldest records away - in
+ * fan-out mode, where only writers move the tail, and
+ * all of them hold produce_lock to do it. If there's
+ * no room, it's -ENOSPC. This never sleeps. */
+static int ring_reserve(struct ring *r, size_t len,
+                        int overwrite,
+                        struct policy_stats *stats,
+                        unsigned int *pos)
+{
+  struct char_dev_record hdr = {
+    .length = len | RECORD_BUSY,
+  };
+  unsigned long flags;
+
+  spin_lock_irqsave(&r->produce_lock, flags);
+
+  while (!ring_has_room(r, len)) {
+    if (!overwrite || r->tail == r->head) {
+      spin_unlock_irqrestore(&r->produce_lock, flags);
+      return -ENOSPC;
+    }
+    atomic64_add(ring_drop_oldest(r), &stats->dropped);
+  }
+
+  *pos = r->reserve;
+  ring_put(r, *pos, &hdr, RECORD_HDR);
+  r->reserve += RECORD_HDR + len;
+
+  spin_unlock_irqrestore(&r->produce_lock, flags);
+
+  return 0;
+}
+
+
+/* Reserve room for a record of len bytes, like
+ * ring_reserve, by throwing the oldest records away
+ * until there is (record mode, where that takes the
+ * reader's lock). Only records which are all there -
+ * the ones before the head - may go, so if all that's
+ * left is records other writers are still filling in,
+ * it's -ENOSPC. So is a reader holding the lock - it
+ * may be copying to a page which isn't there yet, and
+ * an overwriting writer never waits for a reader. */
+static int ring_overwrite(struct ring *r, size_t len,
+                          struct policy_stats *stats,
+                          unsigned int *pos)
+{
+  int ret;
+
+  if (!mutex_trylock(&r->read_lock))
+    return -ENOSPC;
+
+  while ((ret = ring_reserve(r, len, 0, stats, pos)) != 0 &&
+         r->tail != READ_ONCE(r->head))
+    atomic64_add(ring_drop_oldest(r), &stats->dropped);
+
+  mutex_unlock(&r->read_lock);
+
+  return ret;
+}
+
+
+/* The record at pos has been written - or, with
+ * CHAR_DEV_RECORD_DISCARD in flags, is to be skipped.
+ * Move the head past it, and past the ones after it
+ * which were done first, and had to wait for it.
+ * Returns 1 if the head moved, so there's something
+ * new for the readers. */
+static int ring_commit(struct ring *r, unsigned int pos,
+                       size_t len, u32 flags)
+{
+  struct char_dev_record hdr = {
+    .length = len | flags,
+  };
+  unsigned long irqflags;
+  unsigned int head;
+  int moved;
+
+  /* The record has to be in memory before its header
+   * says it's done */
+  smp_wmb();
+
+  spin_lock_irqsave(&r->produce_lock, irqflags);
+
+  ring_put(r, pos, &hdr, RECORD_HDR);
+
+  for (head = r->head; head != r->reserve;
+       head += RECORD_HDR + RECORD_LENGTH(hdr)) {
+    ring_get(r, head, &hdr, RECORD_HDR);
+    if (hdr.length & RECORD_BUSY)
+      break;
+    r->head_seq++;
+  }
+
+  /* ... and the headers before the readers can see
+   * the new head */
+  smp_wmb();
+  moved = head != r->head;
+  WRITE_ONCE(r->head, head);
+
+  spin_unlock_irqrestore(&r->produce_lock, irqflags);
+
+  return moved;
+}
 
-/* How far did the process reading the message get? 
- * Useful if the message is larger than the size of the 
- * buffer we get to fill in device_read. */
-static char *Message_Ptr;
 
+/* Signal db's eventfd, and start counting again. The
+ * ring's doorbell_lock is held. */
+static void doorbell_ring(struct doorbell *db)
+{
+  eventfd_signal(db->ctx);
+  atomic64_inc(&Doorbell_Rings);
+  db->new_bytes = 0;
+  db->new_records = 0;
+}
 
-/* This function is called whenever a process attempts 
+
+/* The timeout went off before the watermarks were
+ * reached. This is in interrupt context. */
+static enum hrtimer_restart doorbell_timeout(
+    struct hrtimer *timer)
+{
+  struct doorbell *db = container_of(timer,
+                                     struct doorbell,
+                                     timer);
+  unsigned long flags;
+
+  spin_lock_irqsave(&db->ring->doorbell_lock, flags);
+  if (db->new_records) {
+    doorbell_ring(db);
+    atomic64_inc(&Doorbell_Timeouts);
+  }
+  spin_unlock_irqrestore(&db->ring->doorbell_lock, flags);
+
+  return HRTIMER_NORESTART;
+}
+
+
+/* records records, of bytes bytes between them, were
+ * just written to r - tell its doorbells, and ring
+ * the ones which reached their watermark. The first
+ * record since a doorbell last rang starts its
+ * timeout. This never sleeps, so char_dev_commit can
+ * call it too. */
+static void ring_doorbells(struct ring *r, size_t bytes,
+                           unsigned int records)
+{
+  struct doorbell *db;
+  unsigned long flags;
+
+  if (records == 0 || list_empty(&r->doorbells))
+    return;
+
+  spin_lock_irqsave(&r->doorbell_lock, flags);
+  list_for_each_entry(db, &r->doorbells, list) {
+    if (db->new_records == 0 && db->timeout)
+      hrtimer_start(&db->timer, db->timeout,
+                    HRTIMER_MODE_REL);
+
+    db->new_bytes += bytes;
+    db->new_records += records;
+    atomic64_add(records, &Doorbell_Records);
+
+    if ((db->bytes && db->new_bytes >= db->bytes) ||
+        (db->records && db->new_records >= db->records)) {
+      /* It may be running, waiting for the lock - it
+       * finds nothing new, then */
+      hrtimer_try_to_cancel(&db->timer);
+      doorbell_ring(db);
+    }
+  }
+  spin_unlock_irqrestore(&r->doorbell_lock, flags);
+}
+
+
+/* Give rf the doorbell req asks for, in place of the
+ * one it had - or, if req's fd is negative, none */
+static int doorbell_set(struct ring_file *rf,
+                        const struct char_dev_doorbell *req)
+{
+  struct ring *r = rf->ring;
+  struct doorbell *db = NULL, *old;
+  struct eventfd_ctx *ctx;
+
+  if (req->fd >= 0) {
+    ctx = eventfd_ctx_fdget(req->fd);
+    if (IS_ERR(ctx))
+      return PTR_ERR(ctx);
+
+    db = kzalloc(sizeof(*db), GFP_KERNEL);
+    if (db == NULL) {
+      eventfd_ctx_put(ctx);
+      return -ENOMEM;
+    }
+
+    db->ctx = ctx;
+    db->ring = r;
+    db->bytes = req->bytes;
+    db->records = req->records;
+    /* No watermark - ring for every record */
+    if (db->bytes == 0 && db->records == 0)
+      db->records = 1;
+    db->timeout = us_to_ktime(req->timeout_us);
+    hrtimer_setup(&db->timer, doorbell_timeout,
+                  CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  }
+
+  spin_lock_irq(&r->doorbell_lock);
+  old = rf->doorbell;
+  if (old)
+    list_del(&old->list);
+  if (db)
+    list_add_tail(&db->list, &r->doorbells);
+  rf->doorbell = db;
+  spin_unlock_irq(&r->doorbell_lock);
+
+  /* Nobody can find the old one now, but its timer
+   * may still be going off */
+  if (old) {
+    hrtimer_cancel(&old->timer);
+    eventfd_ctx_put(old->ctx);
+    kfree(old);
+  }
+
+  return 0;
+}
+
+
+/* The oldest record still in the ring - its number,
+ * and its index in *pos (fan-out mode) */
+static u64 fanout_tail(struct ring *r, unsigned int *pos)
+{
+  unsigned int seq;
+  u64 tail;
+
+  do {
+    seq = read_seqbegin(&r->tail_lock);
+    *pos = r->tail;
+    tail = r->tail_seq;
+  } while (read_seqretry(&r->tail_lock, seq));
+
+  return tail;
+}
+
+
+/* Add the records in from to the ring. Returns the
+ * number of bytes written, not counting the headers.
+ * A record which doesn't fit in the ring at all (see
+ * RECORD_MAX) is -EMSGSIZE. What happens to one which doesn't fit in
+ * what's left of it now depends on the file's policy:
+ *
+ * block     - we wait until the reader makes room (or
+ *             say -EAGAIN, if we mayn't wait)
+ * eagain    - we say -EAGAIN
+ * drop      - we throw the record away, and count it
+ *             as written
+ * overwrite - we throw the oldest records away (or,
+ *             if the reader is busy, or only records
+ *             other writers are still filling in are
+ *             left, this one)
+ *
+ * Either way, if we wrote some records before it, the
+ * writer gets the count of those first, and the rest
+ * of the writev is left. */
+static ssize_t record_write_iter(struct kiocb *iocb,
+                                 struct iov_iter *from)
+{
+  struct ring_file *rf = iocb->ki_filp->private_data;
+  struct policy_stats *stats = &Stats[rf->policy];
+  struct ring *r = rf->ring;
+  ssize_t written = 0, ret;
+  int moved = 0;
+  unsigned int pos, records = 0;
+  size_t stored = 0;  /* written, less what was dropped */
+  u64 start;
+  size_t len;
+
+  count_access(r);
+
+  ret = record_lock(&r->write_lock, iocb);
+  if (ret)
+    return ret;
+
+  while (iov_iter_count(from)) {
+    len = record_room(from);
+    if (len == 0)
+      break;
+
+    if (len > RECORD_MAX) {
+      ret = -EMSGSIZE;
+      break;
+    }
+
+    /* In fan-out mode, ring_reserve overwrites by
+     * itself */
+    ret = ring_reserve(r, len, Mode == MODE_FANOUT, stats,
+                       &pos);
+    if (ret && rf->policy == CHAR_DEV_POLICY_OVERWRITE &&
+        Mode == MODE_RECORD)
+      ret = ring_overwrite(r, len, stats, &pos);
+
+    if (ret) {
+      /* Dropping and overwriting never wait - if
+       * there's nothing left to overwrite, the record is
+       * dropped */
+      if (rf->policy == CHAR_DEV_POLICY_DROP_NEWEST ||
+          rf->policy == CHAR_DEV_POLICY_OVERWRITE) {
+        iov_iter_advance(from, len);
+        atomic64_add(len, &stats->dropped);
+        written += len;
+        continue;
+      }
+
+      /* Wait for room for the record - unless we may
+       * not, or we've written records already, which
+       * the writer should hear about first */
+      if (written)
+        break;
+      if (rf->policy == CHAR_DEV_POLICY_EAGAIN ||
+          nonblocking(iocb)) {
+        atomic64_inc(&stats->refused);
+        ret = -EAGAIN;
+        break;
+      }
+
+      mutex_unlock(&r->write_lock);
+      start = ktime_get_ns();
+      ret = wait_event_interruptible(r->write_wq,
+                                     ring_has_room(r, len));
+      atomic64_add(ktime_get_ns() - start,
+                   &stats->blocked_ns);
+      if (ret)
+        return -ERESTARTSYS;
+      if (mutex_lock_interruptible(&r->write_lock))
+        return -ERESTARTSYS;
+      continue;
+    }
+
+    /* The room is ours now. If the process gave us a
+     * bad buffer, we can't give it back - there may be
+     * records after it - so the readers are told to
+     * skip it. */
+    if (ring_copy_from_iter(r, pos + RECORD_HDR, len,
+                            from) != len) {
+      moved |= ring_commit(r, pos, len,
+                           CHAR_DEV_RECORD_DISCARD);
+      ret = -EFAULT;
+      break;
+    }
+
+    moved |= ring_commit(r, pos, len, 0);
+    atomic64_inc(&stats->records);
+    written += len;
+    stored += len;
+    records++;
+  }
+
+  mutex_unlock(&r->write_lock);
+
+  /* One wake up for the whole writev */
+  if (moved)
+    record_wake(&r->read_wq, EPOLLIN | EPOLLRDNORM);
+  ring_doorbells(r, stored, records);
+
+  return written ? written : ret;
+}
+
+
+/* Give the reader as many whole records as fit, each
+ * with its header. Returns the number of bytes read,
+ * headers included, or -EMSGSIZE if not even the first
+ * record fits. For readv, that's the sum of what was
+ * put at the start of each iovec - the reader takes
+ * the header from one iovec after the other until it
+ * has accounted for all of it.
+ *
+ * If there are no records, we wait for some, the same
+ * way trace_read in syscall.c does. */
+static ssize_t record_read_iter(struct kiocb *iocb,
+                                struct iov_iter *to)
+{
+  struct ring_file *rf = iocb->ki_filp->private_data;
+  struct ring *r = rf->ring;
+  struct char_dev_record hdr;
+  ssize_t done = 0, ret;
+  unsigned int head;
+  size_t room;
+
+  if (iov_iter_count(to) == 0)
+    return 0;
+
+  count_access(r);
+
+  ret = record_lock(&r->read_lock, iocb);
+  if (ret)
+    return ret;
+
+again:
+  while (r->tail == READ_ONCE(r->head)) {
+    mutex_unlock(&r->read_lock);
+
+    if (nonblocking(iocb))
+      return -EAGAIN;
+
+    if (wait_event_interruptible(r->read_wq,
+                                 r->tail != READ_ONCE(r->head)))
+      return -ERESTARTSYS;
+
+    if (mutex_lock_interruptible(&r->read_lock))
+      return -ERESTARTSYS;
+  }
+
+  head = r->head;
+
+  /* Don't look at a record before we've seen the head
+   * which covers it */
+  smp_rmb();
+
+  while (r->tail != head && iov_iter_count(to)) {
+    room = record_room(to);
+    ring_get(r, r->tail, &hdr, RECORD_HDR);
+
+    if (hdr.length & CHAR_DEV_RECORD_DISCARD) {
+      r->tail += RECORD_HDR + RECORD_LENGTH(hdr);
+      continue;
+    }
+
+    if (RECORD_HDR + hdr.length > room) {
+      if (done == 0)
+        ret = -EMSGSIZE;
+      break;
+    }
+
+    if (copy_to_iter(&hdr, RECORD_HDR, to) != RECORD_HDR ||
+        ring_copy_to_iter(r, r->tail + RECORD_HDR,
+                          hdr.length, to) != hdr.length) {
+      ret = -EFAULT;
+      break;
+    }
+
+    /* One record per iovec - skip what's left of it */
+    if (iter_is_iovec(to))
+      iov_iter_advance(to, room - RECORD_HDR - hdr.length);
+    done += RECORD_HDR + hdr.length;
+
+    /* We must be done with the record before the
+     * writer may reuse its space */
+    smp_mb();
+    r->tail += RECORD_HDR + hdr.length;
+  }
+
+  /* There were only records to skip - wait for some
+   * to read */
+  if (done == 0 && ret == 0) {
+    record_wake(&r->write_wq, EPOLLOUT | EPOLLWRNORM);
+    goto again;
+  }
+
+  mutex_unlock(&r->read_lock);
+
+  if (done)
+    record_wake(&r->write_wq, EPOLLOUT | EPOLLWRNORM);
+
+  return done ? done : ret;
+}
+
+
+/* Read in fan-out mode. Like record_read_iter, but
+ * from the reader's own cursor, and the records stay
+ * in the ring for the other readers. Nothing stops the
+ * writer from overwriting a record while we copy it,
+ * so after each one we check that it was still in the
+ * ring when we were done with it. If it wasn't (or the
+ * one before it), the reader has been overrun: we
+ * catch it up to the oldest record, count what it
+ * missed, and fail with -EPIPE - unless it has records
+ * from this read, which it gets first. */
+static ssize_t fanout_read_iter(struct kiocb *iocb,
+                                struct iov_iter *to)
+{
+  struct ring_file *reader = iocb->ki_filp->private_data;
+  struct ring *r = reader->ring;
+  struct char_dev_record hdr;
+  ssize_t done = 0, ret;
+  unsigned int head, tail;
+  u64 oldest;
+  size_t room;
+
+  if (iov_iter_count(to) == 0)
+    return 0;
+
+  count_access(r);
+
+  ret = record_lock(&reader->lock, iocb);
+  if (ret)
+    return ret;
+
+again:
+  while (reader->pos == READ_ONCE(r->head)) {
+    mutex_unlock(&reader->lock);
+
+    if (nonblocking(iocb))
+      return -EAGAIN;
+
+    if (wait_event_interruptible(r->read_wq,
+                                 reader->pos != READ_ONCE(r->head)))
+      return -ERESTARTSYS;
+
+    if (mutex_lock_interruptible(&reader->lock))
+      return -ERESTARTSYS;
+  }
+
+  head = READ_ONCE(r->head);
+  smp_rmb();
+
+  while (reader->pos != head && iov_iter_count(to)) {
+    if (fanout_tail(r, &tail) > reader->seq)
+      break;
+
+    room = record_room(to);
+    ring_get(r, reader->pos, &hdr, RECORD_HDR);
+
+    /* A header the writer is overwriting may say
+     * anything - we'll find out below */
+    if (RECORD_LENGTH(hdr) > RECORD_MAX)
+      break;
+
+    if (hdr.length & CHAR_DEV_RECORD_DISCARD) {
+      smp_rmb();
+      if (fanout_tail(r, &tail) > reader->seq)
+        break;
+      reader->pos += RECORD_HDR + RECORD_LENGTH(hdr);
+      reader->seq++;
+      continue;
+    }
+
+    if (RECORD_HDR + hdr.length > room) {
+      if (done == 0)
+        ret = -EMSGSIZE;
+      break;
+    }
+
+    if (copy_to_iter(&hdr, RECORD_HDR, to) != RECORD_HDR ||
+        ring_copy_to_iter(r, reader->pos + RECORD_HDR,
+                          hdr.length, to) != hdr.length) {
+      ret = -EFAULT;
+      break;
+    }
+
+    /* Was the record still there when we were done
+     * copying it? If not, what we copied isn't counted
+     * in what we return. */
+    smp_rmb();
+    if (fanout_tail(r, &tail) > reader->seq)
+      break;
+
+    if (iter_is_iovec(to))
+      iov_iter_advance(to, room - RECORD_HDR - hdr.length);
+    done += RECORD_HDR + hdr.length;
+    reader->pos += RECORD_HDR + hdr.length;
+    reader->seq++;
+  }
+
+  if (done == 0) {
+    oldest = fanout_tail(r, &tail);
+    if (oldest > reader->seq) {
+      reader->overrun += oldest - reader->seq;
+      reader->seq = oldest;
+      reader->pos = tail;
+      ret = -EPIPE;
+    }
+  }
+
+  /* There were only records to skip */
+  if (done == 0 && ret == 0)
+    goto again;
+
+  mutex_unlock(&reader->lock);
+
+  return done ? done : ret;
+}
+
+
+/* Move the file's position, for lseek (and so, for
+ * fseek). The device is BUF_LEN bytes long at most,
+ * and SEEK_END is relative to the end of the message.
+ * A ring can't be seeked in. */
+static loff_t device_llseek(struct file *file,
+                            loff_t offset, int whence)
+{
+  if (Mode != MODE_MESSAGE)
+    return -ESPIPE;
+
+  return generic_file_llseek_size(file, offset, whence,
+                                  BUF_LEN,
+                                  READ_ONCE(Message_Len));
+}
+
+
+/* Called by poll, select and epoll - and by io_uring,
+ * when a read or write said -EAGAIN - to find out if a
+ * read or a write would have to wait. poll_wait puts
+ * the caller on our wait queues, so it hears when that
+ * changes. In message mode nothing ever waits. */
+static __poll_t device_poll(struct file *file,
+                            poll_table *wait)
+{
+  struct ring_file *reader = file->private_data;
+  struct ring *r;
+  __poll_t mask = 0;
+
+  if (Mode == MODE_MESSAGE)
+    return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+
+  r = reader->ring;
+  poll_wait(file, &r->read_wq, wait);
+
+  /* A fan-out writer never waits, and each reader has
+   * records of its own */
+  if (Mode == MODE_FANOUT) {
+    if (READ_ONCE(reader->pos) != READ_ONCE(r->head))
+      mask |= EPOLLIN | EPOLLRDNORM;
+    return mask | EPOLLOUT | EPOLLWRNORM;
+  }
+
+  poll_wait(file, &r->write_wq, wait);
+
+  if (r->tail != READ_ONCE(r->head))
+    mask |= EPOLLIN | EPOLLRDNORM;
+  if (ring_has_room(r, 1))
+    mask |= EPOLLOUT | EPOLLWRNORM;
+
+  return mask;
+}
+
+
+/* Records from other modules ********************** */
+
+
+/* The ring for a record made on this CPU, or NULL if
+ * there's none yet. This may be in an interrupt, so it
+ * can't make one, like open_ring would. */
+static struct ring *producer_ring(void)
+{
+  int nid = numa_mem_id();
+
+  if (Mode == MODE_MESSAGE)
+    return NULL;
+
+  if (per_node)
+    return Rings[nid] ? Rings[nid] : Rings[first_memory_node];
+
+  return smp_load_acquire(&Rings[0]);
+}
+
+
+/* Make room for a record - see chardev.h. There's no
+ * file, so no file's policy - what we do counts
+ * towards the line of the module's policy parameter in
+ * /proc/char_dev. */
+int char_dev_reserve(struct char_dev_reservation *res,
+                     size_t len)
+{
+  struct policy_stats *stats = &Stats[Policy];
+  struct ring *r = producer_ring();
+
+  if (r == NULL)
+    return -ENODEV;
+
+  if (len > RECORD_MAX)
+    return -EMSGSIZE;
+
+  if (ring_reserve(r, len, Mode == MODE_FANOUT, stats,
+                   &res->pos) != 0) {
+    atomic64_add(len, &stats->dropped);
+    return -ENOSPC;
+  }
+
+  res->ring = r;
+  res->len = len;
+
+  return 0;
+}
+EXPORT_SYMBOL_GPL(char_dev_reserve);
+
+
+/* Put len bytes of the record, offset bytes into it */
+void char_dev_fill(struct char_dev_reservation *res,
+                   size_t offset, const void *data,
+                   size_t len)
+{
+  if (WARN_ON_ONCE(offset > res->len ||
+                   len > res->len - offset))
+    return;
+
+  ring_put(res->ring, res->pos + RECORD_HDR + offset,
+           data, len);
+}
+EXPORT_SYMBOL_GPL(char_dev_fill);
+
+
+/* The record is all there - let the readers have it */
+void char_dev_commit(struct char_dev_reservation *res)
+{
+  struct ring *r = res->ring;
+
+  atomic64_inc(&Stats[Policy].records);
+
+  if (ring_commit(r, res->pos, res->len, 0))
+    record_wake(&r->read_wq, EPOLLIN | EPOLLRDNORM);
+  ring_doorbells(r, res->len, 1);
+}
+EXPORT_SYMBOL_GPL(char_dev_commit);
+
+
+/* Put a record that's all in data in the ring */
+int char_dev_write(const void *data, size_t len)
+{
+  struct char_dev_reservation res;
+  int ret;
+
+  ret = char_dev_reserve(&res, len);
+  if (ret)
+    return ret;
+
+  char_dev_fill(&res, 0, data, len);
+  char_dev_commit(&res);
+
+  return 0;
+}
+EXPORT_SYMBOL_GPL(char_dev_write);
+
+
+/* Mapping the ring ********************************* */
+
+
+/* The page frame of page pgoff of r */
+static unsigned long ring_pfn(struct ring *r, pgoff_t pgoff)
+{
+  void *addr = r->data + (pgoff << PAGE_SHIFT);
+
+  if (r->pages)
+    return page_to_pfn(r->pages[pgoff]);
+  if (is_vmalloc_addr(addr))
+    return vmalloc_to_pfn(addr);
+  return virt_to_phys(addr) >> PAGE_SHIFT;
+}
+
+
+/* A process touched a page of its mapping of the ring
+ * which isn't mapped yet. We map just that page. */
+static vm_fault_t ring_fault(struct vm_fault *vmf)
+{
+  struct vm_area_struct *vma = vmf->vma;
+  struct ring_file *rf = vma->vm_file->private_data;
+
+  atomic64_inc(&Small_Faults);
+  return vmf_insert_pfn(vma, vmf->address,
+                        ring_pfn(rf->ring, vmf->pgoff));
+}
+
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/* The kernel would rather map a whole huge page at
+ * once, if the ring is made of them, and the part of
+ * the mapping around the address lines up with one.
+ * If not, we say VM_FAULT_FALLBACK, and ring_fault
+ * maps a small page instead. */
+static HUGE_FAULT(ring_huge_fault)
+{
+  struct vm_area_struct *vma = vmf->vma;
+  struct ring_file *rf = vma->vm_file->private_data;
+  unsigned long addr = vmf->address & PMD_MASK;
+  pgoff_t pgoff;
+
+  if (!HUGE_FAULT_PMD || rf->ring->pages == NULL)
+    return VM_FAULT_FALLBACK;
+
+  pgoff = vmf->pgoff - ((vmf->address - addr) >> PAGE_SHIFT);
+  if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end ||
+      pgoff % HUGE_PAGES != 0)
+    return VM_FAULT_FALLBACK;
+
+  atomic64_inc(&Huge_Faults);
+  return insert_pfn_pmd(vmf, ring_pfn(rf->ring, pgoff), false);
+}
+#endif
+
+
+static const struct vm_operations_struct Ring_VM_Ops = {
+  .fault = ring_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+  .huge_fault = ring_huge_fault,
+#endif
+};
+
+
+/* Map the file's ring into a process, to read. The
+ * offsets in the mapping are the offsets in the ring
+ * - IOCTL_GET_RING says where the records are. The
+ * pages get mapped as they're touched. VM_PFNMAP
+ * tells the kernel not to look for the struct page
+ * behind them, and VM_HUGEPAGE that it may use huge
+ * ones (even if transparent huge pages are only for
+ * those who ask). */
+static int device_mmap(struct file *file,
+                       struct vm_area_struct *vma)
+{
+  struct ring_file *rf = file->private_data;
+  unsigned long pages = vma_pages(vma);
+
+  if (Mode == MODE_MESSAGE)
+    return -ENODEV;
+  if (vma->vm_flags & VM_WRITE)
+    return -EPERM;
+  if (vma->vm_pgoff > ring_size >> PAGE_SHIFT ||
+      pages > (ring_size >> PAGE_SHIFT) - vma->vm_pgoff)
+    return -EINVAL;
+
+  vm_flags_clear(vma, VM_MAYWRITE);
+  vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
+  if (rf->ring->pages)
+    vm_flags_set(vma, VM_HUGEPAGE);
+  vma->vm_ops = &Ring_VM_Ops;
+
+  return 0;
+}
+
+
+
+/* This function is called whenever a process attempts
  * to open the device file */
-static int device_open(struct inode *inode, 
+static int device_open(struct inode *inode,
                        struct file *file)
 {
+  struct ring_file *rf;
+  struct ring *r;
+
 #ifdef DEBUG
   printk ("device_open(%p)\n", file);
 #endif
 
-  /* We don't want to talk to two processes at the 
-   * same time */
-  if (Device_Open)
-    return -EBUSY;
-
-  /* If this was a process, we would have had to be 
-   * more careful here, because one process might have 
-   * checked Device_Open right before the other one 
-   * tried to increment it. However, we're in the 
-   * kernel, so we're protected against context switches.
-   *
-   * This is NOT the right attitude to take, because we
-   * might be running on an SMP box, but we'll deal with
-   * SMP in a later chapter.
-   */ 
+  /* Our read_iter and write_iter know IOCB_NOWAIT
+   * (see nonblocking above) */
+  file->f_mode |= FMODE_NOWAIT;
+
+  /* The file gets the device's policy, and its ring
+   * (see open_ring). In fan-out mode, its reader starts
+   * with the next record written - holding
+   * produce_lock keeps the writers from moving the head
+   * between the two. */
+  if (Mode != MODE_MESSAGE) {
+    r = open_ring();
+    if (r == NULL)
+      return -ENOMEM;
+
+    rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+    if (rf == NULL)
+      return -ENOMEM;
+    rf->policy = Policy;
+    rf->ring = r;
+    mutex_init(&rf->lock);
+
+    spin_lock_irq(&r->produce_lock);
+    rf->pos = r->head;
+    rf->seq = r->head_seq;
+    spin_unlock_irq(&r->produce_lock);
+
+    file->private_data = rf;
+  }
 
-  Device_Open++;
+  /* In record and fan-out modes, the locks keep the
+   * processes out of each other's way. The device is a
+   * stream there - a record has no position to seek
+   * to, or to pread from. */
+  if (Mode != MODE_MESSAGE)
+    return stream_open(inode, file);
 
-  /* Initialize the message */
-  Message_Ptr = Message;
+  /* We don't want to talk to two processes at the
+   * same time.
+   *
+   * We used to check Device_Open and then increment
+   * it, on the grounds that in the kernel we're
+   * protected against context switches. We aren't -
+   * not with preemption, and not on an SMP box, where
+   * another CPU can open the device between the check
+   * and the increment. atomic_cmpxchg does both in
+   * one step: it sets Device_Open to 1 only if it was
+   * 0, and tells us what it was. */
+  if (atomic_cmpxchg(&Device_Open, 0, 1) != 0)
+    return -EBUSY;
 
-  MOD_INC_USE_COUNT;
+  /* The module can't be removed while the device is
+   * open - the kernel takes care of that for us now,
+   * because Fops has an owner, so there's no more
+   * MOD_INC_USE_COUNT. */
 
   return SUCCESS;
 }
 
 
-/* This function is called when a process closes the 
- * device file. It doesn't have a return value because 
- * it cannot fail. Regardless of what else happens, you 
- * should always be able to close a device (in 2.0, a 2.2
- * device file could be impossible to close).
- */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-static int device_release(struct inode *inode, 
+/* This function is called when a process closes the
+ * device file. Regardless of what else happens, you
+ * should always be able to close a device. */
+static int device_release(struct inode *inode,
                           struct file *file)
-#else
-static void device_release(struct inode *inode, 
-                           struct file *file)
-#endif
 {
 #ifdef DEBUG
   printk ("device_release(%p,%p)\n", inode, file);
 #endif
- 
+
   /* We're now ready for our next caller */
-  Device_Open --;
+  if (Mode == MODE_MESSAGE)
+    atomic_set(&Device_Open, 0);
 
-  MOD_DEC_USE_COUNT;
+  /* Take the file's doorbell off its ring */
+  if (Mode != MODE_MESSAGE) {
+    struct char_dev_doorbell none = { .fd = -1 };
+
+    doorbell_set(file->private_data, &none);
+  }
+
+  /* kfree takes NULL as well, for message mode */
+  kfree(file->private_data);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
   return 0;
-#endif
 }
 
 
 
-/* This function is called whenever a process which 
- * has already opened the device file attempts to 
- * read from it. */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-static ssize_t device_read(
-    struct file *file,
-    char *buffer, /* The buffer to fill with the data */   
-    size_t length,     /* The length of the buffer */
-    loff_t *offset) /* offset to the file */
-#else
-static int device_read(
-    struct inode *inode,
-    struct file *file,
-    char *buffer,   /* The buffer to fill with the data */ 
-    int length)     /* The length of the buffer 
-                     * (mustn't write beyond that!) */
-#endif
+/* This function is called whenever a process which
+ * has already opened the device file attempts to
+ * read from it.
+ *
+ * We used to get the process' buffer as a pointer and
+ * a length. Now we get an iterator, which may stand
+ * for one buffer (read), several (readv), or the pages
+ * of a pipe (splice, and sendfile, which is built on
+ * it). copy_to_iter fills whichever it is, so splicing
+ * the device into a pipe, and from there to a socket
+ * or a file, never copies the data to user space and
+ * back. */
+static ssize_t device_read_iter(
+    struct kiocb *iocb,  /* The file, and where in it */
+    struct iov_iter *to) /* The buffers to fill */
 {
   /* Number of bytes actually written to the buffer */
-  int bytes_read = 0;
+  size_t bytes_read;
+  loff_t pos = iocb->ki_pos;
 
 #ifdef DEBUG
-  printk("device_read(%p,%p,%d)\n", file, buffer, length);
+  printk("device_read_iter(%p,%zu)\n", iocb->ki_filp,
+         iov_iter_count(to));
 #endif
 
-  /* If we're at the end of the message, return 0 
-   * (which signifies end of file) */
-  if (*Message_Ptr == 0)
+  if (Mode == MODE_RECORD)
+    return record_read_iter(iocb, to);
+  if (Mode == MODE_FANOUT)
+    return fanout_read_iter(iocb, to);
+
+  /* If we're at the end of the message, return 0
+   * (which signifies end of file). pread may ask for
+   * any position at all. */
+  if (pos < 0)
+    return -EINVAL;
+  if (pos >= Message_Len)
     return 0;
 
-  /* Actually put the data into the buffer */
-  while (length && *Message_Ptr)  {
-
-    /* Because the buffer is in the user data segment, 
-     * not the kernel data segment, assignment wouldn't 
-     * work. Instead, we have to use put_user which 
-     * copies data from the kernel data segment to the 
-     * user data segment. */
-    put_user(*(Message_Ptr++), buffer++);
-    length --;
-    bytes_read ++;
-  }
+  /* The rest of the message, or as much of it as
+   * fits */
+  bytes_read = Message_Len - pos;
+  if (bytes_read > iov_iter_count(to))
+    bytes_read = iov_iter_count(to);
+
+  /* Because the buffer may be in the user data
+   * segment, not the kernel data segment, assignment
+   * wouldn't work. copy_to_iter returns how many bytes
+   * it did copy - less than we asked for only if part
+   * of the buffer is bad. */
+  bytes_read = copy_to_iter(Message + pos, bytes_read, to);
+  if (bytes_read == 0)
+    return -EFAULT;
+  iocb->ki_pos += bytes_read;
 
 #ifdef DEBUG
-   printk ("Read %d bytes, %d left\n", bytes_read, length);
+   printk ("Read %zu bytes, %zu left\n", bytes_read,
+           iov_iter_count(to));
 #endif
 
-   /* Read functions are supposed to return the number 
+   /* Read functions are supposed to return the number
     * of bytes actually inserted into the buffer */
   return bytes_read;
 }
 
 
-/* This function is called when somebody tries to 
- * write into our device file. */ 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-static ssize_t device_write(struct file *file,
-                            const char *buffer,
-                            size_t length,
-                            loff_t *offset)
-#else
-static int device_write(struct inode *inode,
-                        struct file *file,
-                        const char *buffer,
-                        int length)
-#endif
+/* This function is called when somebody tries to
+ * write into our device file - with write, writev,
+ * pwrite, or splice from a pipe.
+ *
+ * A write at the start of the device replaces the
+ * message, the way every write used to. One further
+ * on changes the bytes there, and makes the message
+ * longer if it goes past its end - anything between
+ * the end and where the write starts reads as zeros.
+ * Nothing goes past BUF_LEN. */
+static ssize_t device_write_iter(struct kiocb *iocb,
+                                 struct iov_iter *from)
 {
-  int i;
+  size_t length = iov_iter_count(from);
+  loff_t pos = iocb->ki_pos;
+  char buf[BUF_LEN];
+  size_t i;
 
 #ifdef DEBUG
-  printk ("device_write(%p,%s,%d)",
-    file, buffer, length);
+  printk ("device_write_iter(%p,%zu)",
+    iocb->ki_filp, length);
 #endif
 
-  for(i=0; i<length && i<BUF_LEN; i++)
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-    get_user(Message[i], buffer+i);
-#else
-    Message[i] = get_user(buffer+i);
-#endif  
+  if (Mode != MODE_MESSAGE)
+    return record_write_iter(iocb, from);
+
+  if (pos < 0)
+    return -EINVAL;
+  if (pos >= BUF_LEN)
+    return length ? -ENOSPC : 0;
+  i = min_t(size_t, length, BUF_LEN - pos);
+
+  /* If the copy fails, the message stays as it was -
+   * so it goes somewhere else first */
+  if (copy_from_iter(buf, i, from) != i)
+    return -EFAULT;
 
-  Message_Ptr = Message;
+  if (pos == 0)
+    Message_Len = 0;
+  else if (pos > Message_Len)
+    memset(Message + Message_Len, 0, pos - Message_Len);
+  memcpy(Message + pos, buf, i);
+
+  if (pos + i > Message_Len)
+    Message_Len = pos + i;
+  iocb->ki_pos += i;
 
   /* Again, return the number of input characters used */
   return i;
 }
 
 
-/* This function is called whenever a process tries to 
- * do an ioctl on our device file. We get two extra 
- * parameters (additional to the inode and file 
- * structures, which all device functions get): the number
- * of the ioctl called and the parameter given to the 
- * ioctl function.
+/* The ioctls get a plain pointer to the process'
+ * buffer. To use the read and write functions for
+ * them, we give those what they'd get from read and
+ * write - an iterator over that one buffer, and a
+ * kiocb for the file. dir is ITER_DEST to read into
+ * the buffer, ITER_SOURCE to write from it. */
+static ssize_t device_ioctl_rw(struct file *file, int dir,
+                               char __user *buffer,
+                               size_t length)
+{
+  struct iovec iov = {
+    .iov_base = buffer,
+    .iov_len = length,
+  };
+  struct iov_iter iter;
+  struct kiocb kiocb;
+
+  init_sync_kiocb(&kiocb, file);
+  iov_iter_init(&iter, dir, &iov, 1, length);
+
+  if (dir == ITER_SOURCE)
+    return device_write_iter(&kiocb, &iter);
+  return device_read_iter(&kiocb, &iter);
+}
+
+
+/* This function is called whenever a process tries to
+ * do an ioctl on our device file. We get two extra
+ * parameters (additional to the file structure, which
+ * all device functions get): the number of the ioctl
+ * called and the parameter given to the ioctl
+ * function. (It used to get the inode as well, and ran
+ * with the big kernel lock held - that's gone, and
+ * unlocked_ioctl is what's left.)
  *
- * If the ioctl is write or read/write (meaning output 
- * is returned to the calling process), the ioctl call 
+ * If the ioctl is write or read/write (meaning output
+ * is returned to the calling process), the ioctl call
  * returns the output of this function.
  */
-int device_ioctl(
-    struct inode *inode,
+static long device_ioctl(
     struct file *file,
     unsigned int ioctl_num,/* The number of the ioctl */
     unsigned long ioctl_param) /* The parameter to it */
 {
-  int i;
-  char *temp;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-  char ch;
-#endif
+  struct ring_file *reader;
+  long i;
+  char __user *temp;
+  u64 overrun;
+  struct char_dev_ring ring;
+  struct char_dev_doorbell doorbell;
 
   /* Switch according to the ioctl called */
   switch (ioctl_num) {
     case IOCTL_SET_MSG:
-      /* Receive a pointer to a message (in user space) 
-       * and set that to be the device's message. */ 
+      /* Receive a pointer to a message (in user space)
+       * and set that to be the device's message. */
 
       /* Get the parameter given to ioctl by the process */
-      temp = (char *) ioctl_param;
-   
-      /* Find the length of the message */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-      get_user(ch, temp);
-      for (i=0; ch && i<BUF_LEN; i++, temp++)
-        get_user(ch, temp);
-#else
-      for (i=0; get_user(temp) && i<BUF_LEN; i++, temp++)
-	;
-#endif
-
-      /* Don't reinvent the wheel - call device_write */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-      device_write(file, (char *) ioctl_param, i, 0);
-#else
-      device_write(inode, file, (char *) ioctl_param, i);
-#endif
+      temp = (char __user *) ioctl_param;
+
+      /* Find the length of the message. strnlen_user
+       * counts the NULL as well. */
+      i = strnlen_user(temp, BUF_LEN);
+      if (i == 0)
+        return -EFAULT;
+      if (i <= BUF_LEN)
+        i--;
+
+      /* Don't reinvent the wheel - call
+       * device_write_iter */
+      i = device_ioctl_rw(file, ITER_SOURCE, temp, i);
+      if (i < 0)
+        return i;
       break;
 
     case IOCTL_GET_MSG:
-      /* Give the current message to the calling 
-       * process - the parameter we got is a pointer, 
+      /* Give the current message to the calling
+       * process - the parameter we got is a pointer,
        * fill it. */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-      i = device_read(file, (char *) ioctl_param, 99, 0); 
-#else
-      i = device_read(inode, file, (char *) ioctl_param, 99); 
-#endif
-      /* Warning - we assume here the buffer length is 
-       * 100. If it's less than that we might overflow 
-       * the buffer, causing the process to core dump. 
+      i = device_ioctl_rw(file, ITER_DEST,
+                          (char __user *) ioctl_param, 99);
+      if (i < 0)
+        return i;
+      /* Warning - we assume here the buffer length is
+       * 100. If it's less than that we might overflow
+       * the buffer, causing the process to core dump.
        *
-       * The reason we only allow up to 99 characters is 
-       * that the NULL which terminates the string also 
+       * The reason we only allow up to 99 characters is
+       * that the NULL which terminates the string also
        * needs room. */
 
-      /* Put a zero at the end of the buffer, so it 
+      /* Put a zero at the end of the buffer, so it
        * will be properly terminated */
-      put_user('\0', (char *) ioctl_param+i);
+      if (put_user('\0', (char __user *) ioctl_param + i))
+        return -EFAULT;
       break;
 
     case IOCTL_GET_NTH_BYTE:
-      /* This ioctl is both input (ioctl_param) and 
-       * output (the return value of this function) */
-      return Message[ioctl_param];
+      /* This ioctl is both input (ioctl_param) and
+       * output (the return value of this function).
+       *
+       * We used to return Message[ioctl_param] for any
+       * ioctl_param at all, and let the process read
+       * whatever was after Message. Past the end of the
+       * message there's 0, which is where ioctl.c stops;
+       * past the end of Message, there's nothing. To get
+       * more than a byte, use pread. */
+      if (Mode != MODE_MESSAGE || ioctl_param >= BUF_LEN)
+        return -EINVAL;
+      if (ioctl_param >= Message_Len)
+        return 0;
+      return (unsigned char) Message[ioctl_param];
+
+    case IOCTL_GET_OVERRUN:
+      /* How many records this reader missed since it
+       * last asked (fan-out mode only) */
+      if (Mode != MODE_FANOUT)
+        return -EINVAL;
+
+      reader = file->private_data;
+      mutex_lock(&reader->lock);
+      overrun = reader->overrun;
+      reader->overrun = 0;
+      mutex_unlock(&reader->lock);
+
+      if (put_user(overrun, (__u64 __user *) ioctl_param))
+        return -EFAULT;
+      break;
+
+    case IOCTL_SET_POLICY:
+      /* What this file's writes do when the ring is
+       * full */
+      if (Mode == MODE_MESSAGE)
+        return -EINVAL;
+      if (!policy_ok(ioctl_param))
+        return -EINVAL;
+
+      reader = file->private_data;
+      WRITE_ONCE(reader->policy, ioctl_param);
+      break;
+
+    case IOCTL_GET_FREE:
+      /* The longest record a write could add right now
+       * without waiting or losing anything. A message
+       * always has BUF_LEN bytes - it replaces the last
+       * one. */
+      reader = file->private_data;
+      if (Mode == MODE_MESSAGE)
+        i = BUF_LEN;
+      else if (ring_free(reader->ring) > RECORD_HDR)
+        i = min_t(size_t, ring_free(reader->ring) - RECORD_HDR,
+                  RECORD_MAX);
+      else
+        i = 0;
+
+      if (put_user((__u32) i, (__u32 __user *) ioctl_param))
+        return -EFAULT;
+      break;
+
+    case IOCTL_GET_RING:
+      /* Where the records are, for a process which
+       * mapped the ring */
+      if (Mode == MODE_MESSAGE)
+        return -EINVAL;
+
+      reader = file->private_data;
+      ring.size = ring_size;
+      ring.head = READ_ONCE(reader->ring->head);
+      ring.tail = READ_ONCE(reader->ring->tail);
+      ring.huge = reader->ring->pages != NULL;
+
+      if (copy_to_user((void __user *) ioctl_param, &ring,
+                       sizeof(ring)))
+        return -EFAULT;
       break;
+
+    case IOCTL_SET_DOORBELL:
+      /* Signal an eventfd when there are records (see
+       * chardev.h) */
+      if (Mode == MODE_MESSAGE)
+        return -EINVAL;
+
+      if (copy_from_user(&doorbell,
+                         (void __user *) ioctl_param,
+                         sizeof(doorbell)))
+        return -EFAULT;
+
+      return doorbell_set(file->private_data, &doorbell);
   }
 
   return SUCCESS;
 }
 
 
+/* /proc/char_dev - the mode, how full the rings are,
+ * where they are, and what each policy cost so far */
+static int stats_show(struct seq_file *m, void *v)
+{
+  struct numa_stats numa = { 0, 0 };
+  int i;
+
+  seq_printf(m, "mode %s\n", mode);
+  if (Mode == MODE_MESSAGE)
+    return 0;
+
+  seq_printf(m, "ring %u bytes, policy %s\n",
+             ring_size, Policy_Names[Policy]);
+
+  mutex_lock(&Alloc_Lock);
+  for (i = 0; i < MAX_NUMNODES; i++)
+    if (Rings[i])
+      seq_printf(m, "ring on node %d: %u free, %s pages\n",
+                 Rings[i]->node, ring_free(Rings[i]),
+                 Rings[i]->pages == NULL ? "small" :
+                 is_vmalloc_addr(Rings[i]->data) ?
+                   "huge (for mmap only)" :
+                   "huge (for mmap and kernel)");
+  mutex_unlock(&Alloc_Lock);
+
+  if (hugepages)
+    seq_printf(m, "huge pages asked for, %s\n",
+               ring_size < PMD_SIZE ?
+                 "but ring_size is too small for them" :
+                 "see above for what we got");
+  seq_printf(m, "mapping faults: %lld huge, %lld small\n",
+             atomic64_read(&Huge_Faults),
+             atomic64_read(&Small_Faults));
+
+  for_each_possible_cpu(i) {
+    numa.local += per_cpu(Numa_Stats, i).local;
+    numa.remote += per_cpu(Numa_Stats, i).remote;
+  }
+  seq_printf(m, "numa accesses: %llu local, %llu remote\n",
+             numa.local, numa.remote);
+
+  seq_printf(m, "doorbells: %lld records, %lld rings "
+             "(%lld on timeout)\n",
+             atomic64_read(&Doorbell_Records),
+             atomic64_read(&Doorbell_Rings),
+             atomic64_read(&Doorbell_Timeouts));
+
+  seq_printf(m, "%-10s %12s %16s %16s %10s\n", "policy",
+             "records", "blocked ns", "dropped bytes",
+             "refused");
+  for (i = 0; i < CHAR_DEV_POLICIES; i++)
+    seq_printf(m, "%-10s %12lld %16lld %16lld %10lld\n",
+               Policy_Names[i],
+               atomic64_read(&Stats[i].records),
+               atomic64_read(&Stats[i].blocked_ns),
+               atomic64_read(&Stats[i].dropped),
+               atomic64_read(&Stats[i].refused));
+
+  return 0;
+}
+
+
 /* Module Declarations *************************** */
 
 
-/* This structure will hold the functions to be called 
- * when a process does something to the device we 
- * created. Since a pointer to this structure is kept in 
+/* This structure will hold the functions to be called
+ * when a process does something to the device we
+ * created. Since a pointer to this structure is kept in
  * the devices table, it can't be local to
- * init_module. NULL is for unimplemented functions. */
-struct file_operations Fops = {
-  NULL,   /* seek */
-  device_read, 
-  device_write,
-  NULL,   /* readdir */
-  NULL,   /* select */
-  device_ioctl,   /* ioctl */
-  NULL,   /* mmap */
-  device_open,
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-  NULL,  /* flush */
+ * init_module. Functions we don't give are left NULL,
+ * which means the kernel's default. */
+static const struct file_operations Fops = {
+  .owner = THIS_MODULE,
+  .llseek = device_llseek,
+  /* read and write (and readv and writev) go through
+   * these, since we don't give .read and .write */
+  .read_iter = device_read_iter,
+  .write_iter = device_write_iter,
+  /* splice - the kernel moves the data between our
+   * iterators and the pipe's pages itself */
+  .splice_read = copy_splice_read,
+  .splice_write = iter_file_splice_write,
+  .poll = device_poll,
+  .mmap = device_mmap,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+  /* Mappings which line up with huge pages */
+  .get_unmapped_area = thp_get_unmapped_area,
 #endif
-  device_release  /* a.k.a. close */
+  .unlocked_ioctl = device_ioctl,
+  .open = device_open,
+  .release = device_release,  /* a.k.a. close */
 };
 
 
 /* Initialize the module - Register the character device */
-int init_module()
+int init_module(void)
 {
   int ret_val;
 
+  if (strcmp(mode, "record") == 0 ||
+      strcmp(mode, "fanout") == 0) {
+    /* The ring has to be a power of two, so indices
+     * can be turned into offsets with a mask */
+    if (!is_power_of_2(ring_size) || ring_size < PAGE_SIZE) {
+      printk ("ring_size must be a power of two, "
+              "at least %lu\n", PAGE_SIZE);
+      return -EINVAL;
+    }
+    Mode = strcmp(mode, "record") == 0 ? MODE_RECORD
+                                       : MODE_FANOUT;
+  } else if (strcmp(mode, "message") != 0) {
+    printk ("mode must be message, record or fanout\n");
+    return -EINVAL;
+  }
+
+  /* A fan-out writer can only overwrite */
+  if (Mode == MODE_FANOUT)
+    Policy = CHAR_DEV_POLICY_OVERWRITE;
+  if (policy != NULL) {
+    Policy = match_string(Policy_Names, CHAR_DEV_POLICIES,
+                          policy);
+    if (Policy < 0 || !policy_ok(Policy)) {
+      printk ("policy %s doesn't go with mode %s\n",
+              policy, mode);
+      return -EINVAL;
+    }
+  }
+
+  if (Mode != MODE_MESSAGE) {
+    ret_val = rings_init();
+    if (ret_val)
+      return ret_val;
+  }
+
+  if (proc_create_single("char_dev", 0444, NULL,
+                         stats_show) == NULL) {
+    rings_free();
+    return -ENOMEM;
+  }
+
   /* Register the character device (atleast try) */
-  ret_val = module_register_chrdev(MAJOR_NUM, 
-                                 DEVICE_NAME,
-                                 &Fops);
+  ret_val = register_chrdev(MAJOR_NUM,
+                            DEVICE_NAME,
+                            &Fops);
 
   /* Negative values signify an error */
   if (ret_val < 0) {
     printk ("%s failed with %d\n",
             "Sorry, registering the character device ",
             ret_val);
+    remove_proc_entry("char_dev", NULL);
+    rings_free();
     return ret_val;
   }
 
   printk ("%s The major device number is %d.\n",
-          "Registeration is a success", 
+          "Registeration is a success",
           MAJOR_NUM);
   printk ("If you want to talk to the device driver,\n");
   printk ("you'll have to create a device file. \n");
   printk ("We suggest you use:\n");
-  printk ("mknod %s c %d 0\n", DEVICE_FILE_NAME, 
+  printk ("mknod %s c %d 0\n", DEVICE_FILE_NAME,
           MAJOR_NUM);
   printk ("The device file name is important, because\n");
   printk ("the ioctl program assumes that's the\n");
@@ -364,15 +2130,14 @@ int init_module()
 
 
 /* Cleanup - unregister the appropriate file from /proc */
-void cleanup_module()
+void cleanup_module(void)
 {
-  int ret;
-
-  /* Unregister the device */
-  ret = module_unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
- 
-  /* If there's an error, report it */ 
-  if (ret < 0)
-    printk("Error in module_unregister_chrdev: %d\n", ret);
-}  
-
+  /* Unregister the device. This can't fail any more -
+   * the kernel won't unload us while the device is
+   * open. */
+  unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
+  remove_proc_entry("char_dev", NULL);
+
+  /* There are none in message mode */
+  rings_free();
+}
@@ -9,6 +9,7 @@
 #define CHARDEV_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 
 
@@ -50,9 +51,130 @@
   * Message[n]. */
 
 
+/* Get the number of records this reader missed, in
+ * fan-out mode (insmod chardev.ko mode=fanout), since
+ * it last asked - because the writer overwrote them
+ * before it read them. A read fails with EPIPE when
+ * that happens. */
+#define IOCTL_GET_OVERRUN _IOR(MAJOR_NUM, 3, __u64)
+
+
+/* What a write does when the device is full - set
+ * with this ioctl for one open file, or with
+ * insmod chardev.ko policy=<name> for the device.
+ * The names are in brackets. Fan-out mode only has
+ * overwrite. */
+#define IOCTL_SET_POLICY _IOW(MAJOR_NUM, 4, int)
+
+#define CHAR_DEV_POLICY_BLOCK       0  /* Wait for room (block) */
+#define CHAR_DEV_POLICY_EAGAIN      1  /* Fail with EAGAIN (eagain) */
+#define CHAR_DEV_POLICY_DROP_NEWEST 2  /* Lose this record (drop) */
+#define CHAR_DEV_POLICY_OVERWRITE   3  /* Lose the oldest ones
+                                        * (overwrite) */
+#define CHAR_DEV_POLICIES           4
+
+
+/* Get the length of the longest record which can be
+ * written right now without waiting or losing any */
+#define IOCTL_GET_FREE _IOR(MAJOR_NUM, 5, __u32)
+
+
+/* Where the records are, for a process which mapped
+ * the ring (with mmap, in record and fan-out modes).
+ * head and tail run freely - the records are between
+ * tail & (size - 1) and head & (size - 1), and may
+ * wrap around the end of the ring. */
+struct char_dev_ring {
+  __u32 size;  /* Of the ring, in bytes */
+  __u32 head;  /* Where the next record will go */
+  __u32 tail;  /* Where the oldest record is */
+  __u32 huge;  /* 1 if it's made of huge pages */
+};
+
+#define IOCTL_GET_RING _IOR(MAJOR_NUM, 6, struct char_dev_ring)
+
+
+/* Have an eventfd signalled when records are written
+ * (in record and fan-out modes) - once bytes bytes or
+ * records records came since it was last signalled,
+ * or timeout_us microseconds after the first of them,
+ * whichever is first. 0 leaves a watermark out; with
+ * neither, it's every record. The eventfd may be
+ * given to any number of open files, so one read of it
+ * tells a process that some of them have something.
+ * An fd of -1 takes the doorbell away. */
+struct char_dev_doorbell {
+  __s32 fd;          /* The eventfd */
+  __u32 bytes;       /* Bytes of data, headers not counted */
+  __u32 records;
+  __u32 timeout_us;
+};
+
+#define IOCTL_SET_DOORBELL _IOW(MAJOR_NUM, 7, struct char_dev_doorbell)
+
+
+/* In record mode (insmod chardev.ko mode=record), each
+ * record read from the device starts with this header,
+ * and the record's data follows it directly. Records
+ * are written without one - each write, or each iovec
+ * of a writev, is a record. Fan-out mode uses the
+ * same records. */
+struct char_dev_record {
+  __u32 length;  /* Bytes of data after the header */
+};
+
+/* Set in length for a record its writer couldn't
+ * finish (its buffer was bad). Such a record takes up
+ * its room in the ring - with the flag masked off, the
+ * length still says how much - but read never returns
+ * it, and a process which mapped the ring should skip
+ * it too. */
+#define CHAR_DEV_RECORD_DISCARD (1U << 31)
+
+
 /* The name of the device file */
 #define DEVICE_FILE_NAME "char_dev"
 
 
+#ifdef __KERNEL__
+
+/* For other modules, which want to put records in the
+ * ring themselves - from an interrupt handler, say.
+ * None of these sleep, so they're fine in atomic
+ * context. The record goes in the ring for this NUMA
+ * node (with per_node), or the one ring otherwise.
+ *
+ * char_dev_reserve makes room for a record of len
+ * bytes, which the caller then fills in with
+ * char_dev_fill, as many pieces at a time as it likes,
+ * and hands to the readers with char_dev_commit. Every
+ * reservation has to be committed, and soon - readers
+ * don't see the records after it until it is. It's
+ * -ENODEV if nobody has opened the device yet (there's
+ * no ring), -EMSGSIZE if the record could never fit,
+ * and -ENOSPC if it doesn't fit now - we can't wait
+ * for a reader to make room, so that's a dropped
+ * record, in record mode. In fan-out mode, the oldest
+ * records make way.
+ *
+ * char_dev_write does all three for a record which is
+ * in one piece already. */
+struct char_dev_reservation {
+  void *ring;         /* Which ring it's in */
+  unsigned int pos;   /* Where in the ring */
+  size_t len;         /* How long the record is */
+};
+
+int char_dev_reserve(struct char_dev_reservation *res,
+                     size_t len);
+void char_dev_fill(struct char_dev_reservation *res,
+                   size_t offset, const void *data,
+                   size_t len);
+void char_dev_commit(struct char_dev_reservation *res);
+int char_dev_write(const void *data, size_t len);
+
+#endif
+
+
 #endif
 
@@ -0,0 +1,274 @@
+/*  compat.h - what the modules need to build against
+ *  the kernels of today.
+ *
+ *  The modules used to carry their own KERNEL_VERSION
+ *  fallback and their own #if's for 2.0 and 2.2. They
+ *  are now written for current kernels, from 5.4 on,
+ *  and whatever changed between 5.4 and now is papered
+ *  over here, in one place. Every module includes this
+ *  file right after the kernel's headers.
+ */
+
+#ifndef COMPAT_H
+#define COMPAT_H
+
+#include <linux/version.h>
+#include <linux/proc_fs.h>
+#include <linux/hrtimer.h>
+#include <linux/uaccess.h>
+#include <linux/cred.h>
+#include <linux/uidgid.h>
+
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,4,0)
+#error "These modules need a 5.4 or later kernel"
+#endif
+
+
+
+/* /proc files ****************************************** */
+
+
+/* Since 5.6 a /proc file has its own struct proc_ops,
+ * instead of a struct file_operations. The fields have
+ * the same names with proc_ in front, so for older
+ * kernels we just take the prefix off again. A /proc
+ * file has no owner field any more - /proc itself
+ * waits for whoever is inside our functions before
+ * remove_proc_entry returns. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+#define proc_ops file_operations
+#define proc_open open
+#define proc_read read
+#define proc_write write
+#define proc_lseek llseek
+#define proc_release release
+#define proc_poll poll
+#define proc_ioctl unlocked_ioctl
+#define proc_mmap mmap
+#endif
+
+
+/* The data given to proc_create_data. Renamed in
+ * 5.17. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,17,0)
+#define pde_data(inode) PDE_DATA(inode)
+#endif
+
+
+
+/* Files ************************************************ */
+
+
+/* Which way an iov_iter goes. Until 6.1 it was given
+ * as READ or WRITE, from the point of view of the
+ * file - the opposite of the buffer's. */
+#ifndef ITER_SOURCE
+#define ITER_SOURCE WRITE  /* The buffer is read from */
+#define ITER_DEST READ     /* The buffer is written to */
+#endif
+
+
+/* Splicing from a file which has read_iter, by
+ * copying into pages for the pipe. Until 6.5 the
+ * generic function did that for files like ours. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
+#define copy_splice_read generic_file_splice_read
+#endif
+
+
+
+/* Timers *********************************************** */
+
+
+/* hrtimer_setup, which sets the function along with
+ * the rest, came in 6.13. hrtimer_init, which doesn't,
+ * went away soon after. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+static inline void hrtimer_setup(struct hrtimer *timer,
+                                 enum hrtimer_restart
+                                   (*function)(struct hrtimer *),
+                                 clockid_t clock_id,
+                                 enum hrtimer_mode mode)
+{
+  hrtimer_init(timer, clock_id, mode);
+  timer->function = function;
+}
+#endif
+
+
+
+/* User memory ****************************************** */
+
+
+/* Copying a string from user space where we can't
+ * sleep, so a page which isn't there is a failure
+ * rather than a page fault. Renamed in 5.8. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+#define strncpy_from_user_nofault(dst, src, count) \
+  strncpy_from_unsafe_user(dst, src, count)
+#endif
+
+
+
+/* Memory mappings ************************************** */
+
+
+#include <linux/mm.h>
+#include <linux/huge_mm.h>
+
+/* A vma's flags may only be changed with these since
+ * 6.3, so the kernel knows when they change */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+static inline void vm_flags_set(struct vm_area_struct *vma,
+                                vm_flags_t flags)
+{
+  vma->vm_flags |= flags;
+}
+
+static inline void vm_flags_clear(struct vm_area_struct *vma,
+                                  vm_flags_t flags)
+{
+  vma->vm_flags &= ~flags;
+}
+#endif
+
+
+/* A huge_fault handler is told how big a page the
+ * kernel would like - as an enum until 6.6, as an
+ * order since. HUGE_FAULT declares one, and
+ * HUGE_FAULT_PMD says if it's being asked for a page
+ * a PMD maps (2MB, on x86). */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,6,0)
+#define HUGE_FAULT(name) \
+  vm_fault_t name(struct vm_fault *vmf, unsigned int order)
+#define HUGE_FAULT_PMD (order == PMD_SHIFT - PAGE_SHIFT)
+#else
+#define HUGE_FAULT(name) \
+  vm_fault_t name(struct vm_fault *vmf, \
+                  enum page_entry_size pe_size)
+#define HUGE_FAULT_PMD (pe_size == PE_SIZE_PMD)
+#endif
+
+
+/* Mapping a page frame with a PMD. Until 6.17 the
+ * frame number was wrapped in a pfn_t. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,17,0)
+#define insert_pfn_pmd(vmf, pfn, write) \
+  vmf_insert_pfn_pmd(vmf, pfn, write)
+#else
+#include <linux/pfn_t.h>
+#define insert_pfn_pmd(vmf, pfn, write) \
+  vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn), write)
+#endif
+
+
+
+/* Event files ****************************************** */
+
+
+#include <linux/eventfd.h>
+
+/* eventfd_signal adds one to the count. Until 6.8 it
+ * was told how much to add. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,8,0)
+#define eventfd_signal(ctx) eventfd_signal(ctx, 1)
+#endif
+
+
+
+/* The current process ********************************** */
+
+
+/* The user and group IDs of the current process, as
+ * numbers. They live in the process' credentials,
+ * wrapped in types of their own, and are mapped into
+ * the initial namespace, the one root sees. */
+#define CURRENT_UID() from_kuid(&init_user_ns, current_uid())
+#define CURRENT_GID() from_kgid(&init_user_ns, current_gid())
+
+
+
+/* Kernel probes **************************************** */
+
+
+#ifdef CONFIG_KPROBES
+#include <linux/kprobes.h>
+
+/* The probe a return probe instance belongs to. Since
+ * 5.11 the instance doesn't point at it directly. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,11,0)
+#define get_kretprobe(ri) ((ri)->rp)
+#endif
+#endif
+
+
+/* Where the system calls are. On architectures which
+ * have syscall wrappers, the function for a system
+ * call gets the user's registers, not the arguments,
+ * and has the architecture in its name. Elsewhere it's
+ * the plain C function, sys_<name>. SYSCALL_SYMBOL
+ * gives the name to put a probe on, and
+ * syscall_probe_args the six arguments of the system
+ * call, from the registers the probe got. */
+#ifdef CONFIG_ARCH_HAS_SYSCALL_WRAPPER
+#include <asm/syscall.h>
+
+#if defined(CONFIG_X86_64)
+#define SYSCALL_SYMBOL(name) "__x64_sys_" name
+#elif defined(CONFIG_ARM64)
+#define SYSCALL_SYMBOL(name) "__arm64_sys_" name
+#elif defined(CONFIG_RISCV)
+#define SYSCALL_SYMBOL(name) "__riscv_sys_" name
+#elif defined(CONFIG_S390)
+#define SYSCALL_SYMBOL(name) "__s390x_sys_" name
+#else
+#error "Don't know the syscall wrappers of this architecture"
+#endif
+
+static inline void syscall_probe_args(struct pt_regs *regs,
+                                      unsigned long *args)
+{
+  struct pt_regs *user_regs =
+    (struct pt_regs *) regs_get_kernel_argument(regs, 0);
+
+  syscall_get_arguments(current, user_regs, args);
+}
+#else
+#define SYSCALL_SYMBOL(name) "sys_" name
+
+static inline void syscall_probe_args(struct pt_regs *regs,
+                                      unsigned long *args)
+{
+  int i;
+
+  for (i = 0; i < 6; i++)
+    args[i] = regs_get_kernel_argument(regs, i);
+}
+#endif
+
+
+
+/* The keyboard controller ****************************** */
+
+
+/* A filter sees every byte the i8042 keyboard
+ * controller gives the kernel, before the keyboard
+ * driver does. Since 6.13 it gets a context pointer as
+ * well. I8042_FILTER declares one. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+#define I8042_FILTER(name)                               \
+  bool name(unsigned char data, unsigned char str,      \
+            struct serio *serio, void *context)
+#define install_i8042_filter(filter) \
+  i8042_install_filter(filter, NULL)
+#else
+#define I8042_FILTER(name)                               \
+  bool name(unsigned char data, unsigned char str,      \
+            struct serio *serio)
+#define install_i8042_filter(filter) \
+  i8042_install_filter(filter)
+#endif
+
+
+#endif
@@ -8,92 +8,802 @@
 /* Standard in kernel modules */
 #include <linux/kernel.h>               /* We're doing kernel work */
 #include <linux/module.h>               /* Specifically, a module */
-
-/* Deal with CONFIG_MODVERSIONS */
-#if CONFIG_MODVERSIONS==1
-#define MODVERSIONS
-#include <linux/modversions.h>
-#endif        
+#include <linux/moduleparam.h>
 
 #include <linux/sched.h>
-#include <linux/tqueue.h>
 
 /* We want an interrupt */
 #include <linux/interrupt.h>
 
+/* And the bytes the keyboard controller gives the kernel with it */
+#include <linux/i8042.h>
+#include <linux/serio.h>
+
 #include <asm/io.h>
 
-/* In 2.2.3 /usr/include/linux/version.h includes a macro for this, but
- * 2.0.35 doesn't - so I add it here if necessary.
+/* For the threaded mode - the /proc file events are published to, the
+ * timestamps they carry and the thread which publishes them
  */
-#ifndef KERNEL_VERSION
-#define KERNEL_VERSION(a,b,c) ((a)*65536+(b)*256+(c))
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+
+/* For the coalescing mode's poller */
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+
+/* For the statistics - per CPU counters and the cycle counter used to time
+ * both halves of the handler
+ */
+#include <linux/percpu.h>
+#include <linux/cache.h>
+#include <asm/timex.h>
+
+/* What changed between the kernels we build for */
+#include "compat.h"
+
+/* We talk to the PC keyboard controller - through its driver, and in
+ * shared mode through its status port.
+ */
+#if !defined(CONFIG_X86) || !IS_ENABLED(CONFIG_SERIO_I8042)
+#error "intrpt.c needs a PC, with the i8042 keyboard controller driver"
 #endif
 
-/* Bottom Half - this will get called by the kernel as soon as it's safe
- * to do everything normally allowed by kernel modules.
+MODULE_LICENSE("GPL");
+
+/* Where the scancodes come from ************************************** */
+
+/* We used to free IRQ 1, taking it away from the keyboard driver, and
+ * request it for ourselves.  The keyboard was dead until the next reboot -
+ * and the kernel of today won't even let us, since free_irq only removes a
+ * handler with the dev_id we give it.
+ *
+ * The i8042 driver (the one for the PC keyboard controller) lets a module
+ * install a filter instead.  The filter is called from the driver's
+ * interrupt handler, with each byte the driver just read from the
+ * controller, before the driver does anything with it.  That's exactly
+ * where our handler used to get the scancode, without stealing anything -
+ * the filter returns false, and the keyboard gets the byte as well.  So
+ * intrpt_filter is our top half now, except in shared mode (see below),
+ * where we never look at the scancodes at all.
+ */
+
+/* Statistics ********************************************************* */
+
+/* Printing every scancode is by far the most expensive thing this module
+ * does, so it can be turned off (log_events=0), and it's limited to
+ * log_rate messages a second (0 means no limit).  Messages over the limit
+ * are counted, and the count is printed when the next second starts.
+ */
+static int log_events = 1;
+static int log_rate = 50;
+module_param(log_events, int, 0444);
+module_param(log_rate, int, 0444);
+
+/* The histograms have a bucket per power of two - bucket n counts values
+ * from 2^n to 2^(n+1)-1 (bucket 0 also gets the zeros).  The last bucket
+ * takes everything too big for the others.
+ */
+#define HIST_BUCKETS 24
+
+/* Everything is counted separately for each CPU, so the CPUs don't fight
+ * over the cache lines, and so we can tell where the time goes.  A CPU only
+ * ever updates its own entry, without any locking.  The top half can't be
+ * moved to another CPU, so it uses THIS_CPU_STATS.  kintrptd can, at any
+ * moment, so a single counter is bumped with this_cpu_inc, which does it in
+ * one go, and account_bh, which updates several, keeps to its CPU with
+ * get_cpu_ptr while it does.  If the interrupt interrupts a bottom half in
+ * the middle of an update on the same CPU, one count may still get lost -
+ * these are statistics, so we can live with that.
+ */
+struct intrpt_cpu_stats {
+   unsigned long events;                 /* Scancodes read (shared mode -
+                                          * interrupts seen) */
+   unsigned long bh_runs;                /* Bottom half runs, of any kind */
+   unsigned long drops;                  /* Scancodes lost */
+   unsigned long suppressed;             /* printk's over log_rate */
+   unsigned long batch[HIST_BUCKETS];    /* Scancodes per bottom half run */
+   unsigned long top_half[HIST_BUCKETS]; /* Cycles spent in the top half */
+   unsigned long bottom_half[HIST_BUCKETS]; /* Cycles per bottom half run */
+} ____cacheline_aligned;
+
+static DEFINE_PER_CPU(struct intrpt_cpu_stats, Cpu_Stats);
+
+/* Only where we can't be moved to another CPU - see above */
+#define THIS_CPU_STATS this_cpu_ptr(&Cpu_Stats)
+
+/* The bucket a value belongs in */
+static inline int hist_bucket(unsigned long value)
+{
+   int bucket = 0;
+
+   while (value > 1 && bucket < HIST_BUCKETS - 1) {
+      value >>= 1;
+      bucket++;
+   }
+
+   return bucket;
+}
+
+/* Account for one bottom half run, which took cycles and dealt with
+ * events scancodes
  */
-static void got_char(void *scancode)
+static void account_bh(unsigned int events, cycles_t cycles)
 {
+   struct intrpt_cpu_stats *stats = get_cpu_ptr(&Cpu_Stats);
+
+   stats->bh_runs++;
+   stats->batch[hist_bucket(events)]++;
+   stats->bottom_half[hist_bucket((unsigned long) cycles)]++;
+   put_cpu_ptr(&Cpu_Stats);
+}
+
+/* The rate limit state.  It's shared by all the CPUs, so two of them
+ * printing at the very same moment could both get through - which doesn't
+ * matter, it's a limit, not a guarantee.
+ */
+static unsigned long Log_Window = 0;
+static int Log_Count = 0;
+static unsigned long Log_Suppressed = 0;
+
+/* May we printk one more scancode? */
+static int log_allowed(void)
+{
+   if (log_rate == 0)
+      return 1;
+
+   if (jiffies - Log_Window >= HZ) {
+      if (Log_Suppressed)
+         printk("intrpt: %lu scancodes not printed\n", Log_Suppressed);
+      Log_Window = jiffies;
+      Log_Count = 0;
+      Log_Suppressed = 0;
+   }
+
+   if (Log_Count < log_rate) {
+      Log_Count++;
+      return 1;
+   }
+
+   Log_Suppressed++;
+   this_cpu_inc(Cpu_Stats.suppressed);
+   return 0;
+}
+
+/* Report a scancode, if we're allowed to */
+static void got_char(unsigned char scancode)
+{
+   if (!log_events || !log_allowed())
+      return;
+
    printk("Scan Code %x %s.\n",
-          (int) *((char *) scancode) & 0x7F,
-          *((char *) scancode) & 0x80 ? "Released" : "Pressed");
+          (int) scancode & 0x7F,
+          scancode & 0x80 ? "Released" : "Pressed");
+}
+
+/* The scancode for the bottom half to report */
+static unsigned char Scancode;
+
+/* Bottom Half - this will get called by the kernel as soon as it's safe
+ * to do everything normally allowed by kernel modules.  It's a tasklet,
+ * which is what became of the immediate task queue.
+ */
+static void bottom_half(unsigned long unused)
+{
+   cycles_t start = get_cycles();
+
+   got_char(Scancode);
+
+   account_bh(1, get_cycles() - start);
+}
+
+static struct tasklet_struct Bottom_Half;
+
+/* Threaded mode ****************************************************** */
+
+/* If threaded is set (insmod intrpt.ko threaded=1), the bottom half
+ * doesn't run as a tasklet.  Instead, the top half only timestamps the
+ * scancode and puts it in a ring, and a kernel thread of our own,
+ * kintrptd, does the expensive work (the printk) in process context, where
+ * anything more urgent can preempt it.  Every event the thread is done with
+ * is published to /proc/intrpt_events, together with the time the interrupt
+ * arrived and how long it took the thread and the reader to get to it.
+ */
+static int threaded = 0;
+module_param(threaded, int, 0444);
+
+/* The number of events the ring can hold.  It has to be a power of two, so
+ * the free running indices below can be turned into slots with a mask.
+ */
+#define EVENT_RING_SIZE 256
+#define EVENT_SLOT(i) ((i) & (EVENT_RING_SIZE - 1))
+
+struct intrpt_event {
+   unsigned char scancode;
+   u64 irq_stamp;                   /* Taken in the top half, in ns */
+   u64 thread_stamp;                /* Taken when kintrptd got to it */
+};
+
+static struct intrpt_event Events[EVENT_RING_SIZE];
+
+/* Each index has exactly one writer, so the ring needs no lock:
+ *
+ * Event_Head      - advanced by the top half, for each new event
+ * Event_Published - advanced by kintrptd, once it's done with an event
+ * Event_Tail      - advanced by the /proc reader, for each event read
+ *
+ * Event_Tail <= Event_Published <= Event_Head always holds.  The indices
+ * themselves never wrap around, only the slots they map to do.  (The top
+ * half runs under the i8042 driver's lock, so there's only one of it at a
+ * time, even with several CPUs.)
+ */
+static volatile unsigned int Event_Head = 0;
+static volatile unsigned int Event_Published = 0;
+static volatile unsigned int Event_Tail = 0;
+
+/* kintrptd sleeps here until the top half has something for it */
+static DECLARE_WAIT_QUEUE_HEAD(Thread_WaitQ);
+
+/* The thread itself, so cleanup_module can stop it */
+static struct task_struct *Thread;
+
+/* Only one process at a time may consume events from the /proc file */
+static DEFINE_MUTEX(Reader_Lock);
+
+/* The top half of threaded mode - put the event in the ring and wake
+ * kintrptd up.  We're called with interrupts disabled, so this has to be
+ * as short as possible.
+ */
+static void queue_event(unsigned char scancode, u64 stamp)
+{
+   struct intrpt_event *event;
+
+   /* If the ring is full, the oldest events still haven't been read.  We
+    * can't wait for the reader here, so we lose the new event instead.
+    */
+   if (Event_Head - Event_Tail >= EVENT_RING_SIZE) {
+      THIS_CPU_STATS->drops++;
+      return;
+   }
+
+   event = &Events[EVENT_SLOT(Event_Head)];
+   event->scancode = scancode;
+   event->irq_stamp = stamp;
+
+   /* The event has to be in memory before kintrptd can see the new head */
+   smp_wmb();
+   Event_Head++;
+
+   wake_up(&Thread_WaitQ);
+}
+
+/* The threaded half.  It's a normal kernel thread, so unlike a bottom half
+ * it doesn't hold up anything else running on this CPU.  We used to have
+ * to daemonize, name ourselves and block every signal - kthread_run starts
+ * us with all of that done.
+ */
+static int intrpt_thread(void *unused)
+{
+   struct intrpt_event *event;
+   unsigned int batch;
+   cycles_t start;
+
+   for (;;) {
+      wait_event_interruptible(Thread_WaitQ,
+                               kthread_should_stop() ||
+                               Event_Published != Event_Head);
+      if (kthread_should_stop())
+         break;
+
+      /* Don't look at an event before we've seen the head that covers it */
+      smp_rmb();
+
+      start = get_cycles();
+      batch = 0;
+
+      while (Event_Published != Event_Head) {
+         event = &Events[EVENT_SLOT(Event_Published)];
+         event->thread_stamp = ktime_get_real_ns();
+
+         /* This is the expensive part we moved out of the interrupt */
+         got_char(event->scancode);
+
+         /* The reader mustn't see the event before the thread stamp */
+         smp_wmb();
+         Event_Published++;
+         batch++;
+      }
+
+      account_bh(batch, get_cycles() - start);
+   }
+
+   /* kthread_stop is waiting for this, so cleanup_module can unload our
+    * code
+    */
+   return 0;
 }
 
-/* This function services keyboard interrupts. It reads the relevant
- * information from the keyboard and then scheduales the bottom half
- * to run when the kernel considers it safe.
+/* Tell kintrptd to die, and wait until it does */
+static void stop_thread(void)
+{
+   kthread_stop(Thread);
+}
+
+/* The difference between two timestamps, in microseconds */
+static long stamp_diff(u64 later, u64 earlier)
+{
+   return (long) div_s64((s64) (later - earlier), NSEC_PER_USEC);
+}
+
+/* Put the published events into /proc/intrpt_events, one line per event:
+ *
+ *    <scancode> <irq time> thread +<usec> read +<usec>
+ *
+ * where the first delay is from the interrupt to kintrptd and the second
+ * from the interrupt to the process reading the file.  Reading consumes the
+ * events, so each of them is seen only once - which is why only root may read
+ * the file, or anybody could take the events from the process meant to get
+ * them.
  */
-void irq_handler(int irq, void *dev_id, struct pt_regs *regs)
+static int events_show(struct seq_file *m, void *v)
 {
-   /* This variables are static because they need to be 
-    * accessible (through pointers) to the bottom half routine.
+   struct intrpt_event *event;
+   u64 now;
+   u32 nsec;
+
+   mutex_lock(&Reader_Lock);
+   now = ktime_get_real_ns();
+
+   /* Don't look at an event before we've seen that it was published */
+   smp_rmb();
+
+   /* A line is always shorter than 80 characters, so stop while there's
+    * still room for one more - seq_file would throw away a line which
+    * doesn't fit, and the event with it.
     */
-   static unsigned char scancode;
-   static struct tq_struct task = {NULL, 0, got_char, &scancode};
-   unsigned char status;
-
-   /* Read keyboard status */
-   status = inb(0x64);
-   scancode = inb(0x60);
-  
-   /* Scheduale bottom half to run */
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2,2,0)
-   queue_task(&task, &tq_immediate);
-#else
-   queue_task_irq(&task, &tq_immediate);
-#endif
-   mark_bh(IMMEDIATE_BH);
+   while (Event_Tail != Event_Published && m->count + 80 < m->size) {
+      event = &Events[EVENT_SLOT(Event_Tail)];
+      seq_printf(m, "%02x %llu.%06u thread +%ld read +%ld\n",
+                 event->scancode,
+                 div_u64_rem(event->irq_stamp, NSEC_PER_SEC, &nsec),
+                 nsec / (u32) NSEC_PER_USEC,
+                 stamp_diff(event->thread_stamp, event->irq_stamp),
+                 stamp_diff(now, event->irq_stamp));
+
+      /* We must be done with the slot before the top half may reuse it */
+      smp_mb();
+      Event_Tail++;
+   }
+
+   mutex_unlock(&Reader_Lock);
+
+   return 0;
+}
+
+/* Coalescing mode **************************************************** */
+
+/* If coalesce_rate is set (insmod intrpt.ko coalesce_rate=200), we count
+ * the interrupts we get.  Once there are more than coalesce_rate of them a
+ * second, the top half stops giving each scancode a bottom half run of its
+ * own, and only puts it in a queue.  A poller, which runs on a timer once
+ * a tick, drains the queue, but takes no more than poll_budget scancodes
+ * each time, so it can't hog the CPU.  When it finds the queue empty, it
+ * stops, and we're back to a bottom half per scancode.
+ *
+ * This is the same thing network drivers do under NAPI.  We used to mask
+ * the keyboard IRQ and have the poller read the controller itself, but the
+ * IRQ belongs to the keyboard driver now, and it needs every interrupt.
+ * So what we save is bottom half runs rather than interrupts - the logic
+ * is the same.
+ */
+static int coalesce_rate = 0;
+static int poll_budget = 16;
+module_param(coalesce_rate, int, 0444);
+module_param(poll_budget, int, 0444);
+
+/* Bit 5 of the keyboard status (port 0x64) - the waiting byte is from the mouse, not
+ * the keyboard
+ */
+#define KBD_STAT_MOUSE_OBF 0x20
+
+/* The rate is checked over windows of a tenth of a second, so we react to
+ * a burst quickly.  Window_Limit is coalesce_rate scaled to the window.
+ */
+#define COALESCE_WINDOW (HZ/10)
+static unsigned long Window_Start = 0;
+static unsigned int Window_Events = 0;
+static unsigned int Window_Limit = 0;
+
+/* The scancodes waiting for the poller.  A power of two, like the event
+ * ring.
+ */
+#define POLL_QUEUE_SIZE 64
+#define POLL_SLOT(i) ((i) & (POLL_QUEUE_SIZE - 1))
+static unsigned char Poll_Queue[POLL_QUEUE_SIZE];
+static unsigned int Poll_Head = 0, Poll_Tail = 0;
+
+/* Non zero while the poller does the work.  The poller mustn't decide the
+ * queue is empty just as the top half puts another scancode in it, so the
+ * two of them take Poll_Lock to look at Polling and the queue.
+ */
+static int Polling = 0;
+static DEFINE_SPINLOCK(Poll_Lock);
+
+/* The numbers that tell us if this is worth it, for /proc/intrpt_stats */
+static unsigned long Irqs_Taken = 0;        /* Top half calls */
+static unsigned long Poll_Entries = 0;      /* Switches to polling */
+static unsigned long Poll_Runs = 0;         /* Times the poller ran */
+static unsigned long Budget_Exhausted = 0;  /* Runs that hit poll_budget */
+static unsigned long Bh_Saved = 0;          /* Scancodes taken by polling */
+
+/* The timer the poller runs on.  HRTIMER_MODE_REL_SOFT makes it run as a
+ * bottom half (a softirq), like tq_timer did.
+ */
+static struct hrtimer Poll_Timer;
+
+/* Hand a scancode the poller took to whoever would have gotten it from
+ * the top half.  We're already in a bottom half (the timer's), so there's
+ * no need to schedule another one.  In threaded mode, the timestamp is the
+ * time of the poll rather than of the interrupt.
+ */
+static void deliver_polled(unsigned char scancode)
+{
+   if (threaded)
+      queue_event(scancode, ktime_get_real_ns());
+   else
+      got_char(scancode);
+}
+
+/* The poller */
+static enum hrtimer_restart poll_keyboard(struct hrtimer *timer)
+{
+   unsigned char scancode;
+   int work = 0;
+   int polling;
+   cycles_t start;
+
+   Poll_Runs++;
+   start = get_cycles();
+
+   spin_lock_irq(&Poll_Lock);
+   while (work < poll_budget && Poll_Tail != Poll_Head) {
+      scancode = Poll_Queue[POLL_SLOT(Poll_Tail++)];
+
+      /* Don't hold the top half up while we print */
+      spin_unlock_irq(&Poll_Lock);
+      deliver_polled(scancode);
+      work++;
+      spin_lock_irq(&Poll_Lock);
+   }
+
+   /* The queue is empty, go back to a bottom half per scancode with a
+    * fresh window.
+    */
+   if (Poll_Tail == Poll_Head) {
+      Window_Start = jiffies;
+      Window_Events = 0;
+      Polling = 0;
+   }
+   polling = Polling;
+   spin_unlock_irq(&Poll_Lock);
+
+   /* Every scancode we took here would otherwise have been a bottom half
+    * run of its own
+    */
+   Bh_Saved += work;
+   account_bh(work, get_cycles() - start);
+
+   if (!polling)
+      return HRTIMER_NORESTART;
+
+   /* We used up the whole budget and there's more - come back on the next
+    * tick.
+    */
+   Budget_Exhausted++;
+   hrtimer_forward_now(timer, ns_to_ktime(TICK_NSEC));
+   return HRTIMER_RESTART;
+}
+
+/* Called by the top half for each scancode when coalescing is on.  If the
+ * current window has seen too many of them, start the poller.  Returns non
+ * zero if the poller has the scancode, and the top half has nothing more to
+ * do with it.
+ */
+static int check_rate(unsigned char scancode)
+{
+   int queued = 0;
+
+   spin_lock(&Poll_Lock);
+
+   if (!Polling) {
+      if (jiffies - Window_Start >= COALESCE_WINDOW) {
+         Window_Start = jiffies;
+         Window_Events = 0;
+      }
+
+      /* This scancode still goes the normal way, the poller takes the
+       * ones after it.
+       */
+      if (++Window_Events > Window_Limit) {
+         Polling = 1;
+         Poll_Entries++;
+         hrtimer_start(&Poll_Timer, ns_to_ktime(TICK_NSEC),
+                       HRTIMER_MODE_REL_SOFT);
+      }
+   } else {
+      if (Poll_Head - Poll_Tail >= POLL_QUEUE_SIZE)
+         THIS_CPU_STATS->drops++;
+      else
+         Poll_Queue[POLL_SLOT(Poll_Head++)] = scancode;
+      queued = 1;
+   }
+
+   spin_unlock(&Poll_Lock);
+
+   return queued;
+}
+
+/* Print the buckets of a histogram which aren't empty */
+static void print_hist(struct seq_file *m, char *title, unsigned long *hist)
+{
+   int bucket;
+
+   seq_printf(m, "%s\n", title);
+
+   for (bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+      if (hist[bucket] == 0)
+         continue;
+
+      seq_printf(m, "  %10lu-%-10lu %lu\n",
+                 bucket ? 1UL << bucket : 0UL,
+                 bucket < HIST_BUCKETS - 1 ? (2UL << bucket) - 1 : ~0UL,
+                 hist[bucket]);
+   }
+}
+
+/* Put the statistics into /proc/intrpt_stats - the coalescing counters,
+ * the counters for each CPU, and the histograms.  Durations are in cycles
+ * (as returned by get_cycles).  seq_file gives us a bigger buffer if this
+ * doesn't fit, so nothing is left out any more.
+ */
+static int stats_show(struct seq_file *m, void *v)
+{
+   struct intrpt_cpu_stats *stats;
+   unsigned long batch[HIST_BUCKETS];
+   unsigned long top_half[HIST_BUCKETS];
+   unsigned long bottom_half[HIST_BUCKETS];
+   int cpu, bucket;
+
+   seq_printf(m,
+              "irqs taken       %lu\n"
+              "polling entered  %lu\n"
+              "poll runs        %lu\n"
+              "budget exhausted %lu\n"
+              "bh runs saved    %lu\n",
+              Irqs_Taken, Poll_Entries, Poll_Runs,
+              Budget_Exhausted, Bh_Saved);
+
+   /* The counters are given for each CPU, the histograms are summed over
+    * all of them.
+    */
+   memset(batch, 0, sizeof(batch));
+   memset(top_half, 0, sizeof(top_half));
+   memset(bottom_half, 0, sizeof(bottom_half));
+
+   seq_puts(m, "cpu     events    bh runs      drops"
+               " suppressed\n");
+   for_each_possible_cpu(cpu) {
+      stats = per_cpu_ptr(&Cpu_Stats, cpu);
+      seq_printf(m, "%3d %10lu %10lu %10lu %10lu\n",
+                 cpu, stats->events, stats->bh_runs, stats->drops,
+                 stats->suppressed);
+
+      for (bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+         batch[bucket] += stats->batch[bucket];
+         top_half[bucket] += stats->top_half[bucket];
+         bottom_half[bucket] += stats->bottom_half[bucket];
+      }
+   }
+
+   print_hist(m, "batch (scancodes per bottom half run)", batch);
+   print_hist(m, "top half (cycles)", top_half);
+   print_hist(m, "bottom half (cycles)", bottom_half);
+
+   return 0;
+}
+
+/* Shared mode ******************************************************** */
+
+/* If shared is set (insmod intrpt.ko shared=1), we don't install the
+ * filter.  We register as one more handler on IRQ 1, next to the keyboard
+ * driver, and only look at the interrupts going by - we never read the
+ * scancode, since that would take it away from the keyboard driver.  The
+ * i8042 driver registers the IRQ as shared, so this always works now.
+ *
+ * With a shared IRQ, every handler is called for every interrupt, and a
+ * handler which doesn't own a device on the line has to say so quickly.
+ * We own nothing, so we don't ask the controller anything - reading its
+ * status port is a slow trip to a legacy I/O port, and by the time we'd
+ * look the keyboard driver, registered before us, has usually emptied it
+ * anyway.  All this mode does is measure: it counts the interrupts on the
+ * line, and what that costs the keyboard driver's neighbours.
+ *
+ * Coalescing can't be used in this mode, because there's no top half of
+ * ours to do it, and there's nothing for kintrptd to do with scancodes we
+ * never read.
+ */
+static int shared = 0;
+module_param(shared, int, 0444);
+
+/* A shared IRQ has to be registered with a dev_id which is unique to us,
+ * so free_irq knows which of the handlers to remove.  This is it.
+ */
+static int Shared_Cookie;
+
+/* The handler for shared mode.  It never takes care of the interrupt, the
+ * keyboard driver does that, so it counts it and says it didn't.
+ */
+static irqreturn_t shared_irq_handler(int irq, void *dev_id)
+{
+   THIS_CPU_STATS->events++;
+   return IRQ_NONE;
+}
+
+/* This function gets every byte the keyboard controller delivers, from
+ * the keyboard driver's interrupt handler - data is the byte, and str the
+ * controller's status when it was read.  It takes the scancode and
+ * scheduales the bottom half to run when the kernel considers it safe.
+ */
+static I8042_FILTER(intrpt_filter)
+{
+   struct intrpt_cpu_stats *stats = THIS_CPU_STATS;
+   cycles_t start = get_cycles();
+   u64 stamp = 0;
+
+   /* Bytes from the mouse aren't scancodes */
+   if (str & KBD_STAT_MOUSE_OBF)
+      return false;
+
+   /* In threaded mode, the time is taken before anything else, so it's as
+    * close as we can get to when the interrupt really happened.
+    */
+   if (threaded)
+      stamp = ktime_get_real_ns();
+
+   Irqs_Taken++;
+   stats->events++;
+
+   /* Too many interrupts may switch us to polling, and then the poller
+    * gets the scancode.
+    */
+   if (coalesce_rate && check_rate(data))
+      goto out;
+
+   /* In threaded mode kintrptd is our bottom half */
+   if (threaded)
+      queue_event(data, stamp);
+   else {
+      /* If the tasklet is still scheduled, the bottom half never got to
+       * see the scancode we're about to overwrite.
+       */
+      if (test_bit(TASKLET_STATE_SCHED, &Bottom_Half.state))
+         stats->drops++;
+
+      Scancode = data;
+
+      /* Scheduale bottom half to run */
+      tasklet_schedule(&Bottom_Half);
+   }
+
+out:
+   stats->top_half[hist_bucket((unsigned long) (get_cycles() - start))]++;
+
+   /* Let the keyboard driver have the byte too */
+   return false;
 }
 
-/* Initialize the module - register the IRQ handler */
-int init_module()
+/* Initialize the module - install the filter */
+int init_module(void)
 {
-   /* Since the keyboard handler won't co-exist with another handler,
-    * such as us, we have to disable it (free its IRQ) before we do
-    * anything.  Since we don't know where it is, there's no way to
-		* reinstate it later - so the computer will have to be rebooted
-		* when we're done.
+   int ret;
+
+   /* See "Shared mode" above for why these don't mix */
+   if (shared && (threaded || coalesce_rate)) {
+      printk("intrpt: shared can't be used with threaded or coalesce_rate\n");
+      return -EINVAL;
+   }
+
+   Window_Limit = coalesce_rate * COALESCE_WINDOW / HZ;
+   if (Window_Limit < 1)
+      Window_Limit = 1;
+
+   tasklet_init(&Bottom_Half, bottom_half, 0);
+   hrtimer_setup(&Poll_Timer, poll_keyboard, CLOCK_MONOTONIC,
+                 HRTIMER_MODE_REL_SOFT);
+
+   if (proc_create_single("intrpt_stats", 0444, NULL, stats_show) == NULL)
+      return -ENOMEM;
+
+   /* In shared mode we register next to the keyboard handler, and that's
+    * all there is to it.
+    */
+   if (shared) {
+      ret = request_irq(1, shared_irq_handler, IRQF_SHARED,
+                        "test_keyboard_irq_tap", &Shared_Cookie);
+      if (ret < 0) {
+         printk("intrpt: can't share IRQ 1 (%d)\n", ret);
+         remove_proc_entry("intrpt_stats", NULL);
+      }
+      return ret;
+   }
+
+   /* In threaded mode, the thread and the file it publishes to have to be
+    * there before the first scancode arrives.
     */
-   free_irq(1, NULL);
+   if (threaded) {
+      if (proc_create_single("intrpt_events", 0400, NULL,
+                             events_show) == NULL) {
+         remove_proc_entry("intrpt_stats", NULL);
+         return -ENOMEM;
+      }
+
+      Thread = kthread_run(intrpt_thread, NULL, "kintrptd");
+      if (IS_ERR(Thread)) {
+         remove_proc_entry("intrpt_events", NULL);
+         remove_proc_entry("intrpt_stats", NULL);
+         return PTR_ERR(Thread);
+      }
+   }
 
-   /* Request IRQ 1, the keyboard IRQ, to go to our irq_handler.
-	  * SA_SHIRQ means we're willing to have othe handlers on this IRQ.
-		* SA_INTERRUPT can be used to make the handler into a fast interrupt. 
+   /* There's only room for one filter, so this fails with -EBUSY if some
+    * other module (a laptop's hotkey driver, say) got there first.
     */
-   return request_irq(1,   /* The number of the keyboard IRQ on PCs */ 
-              irq_handler, /* our handler */
-              SA_SHIRQ, 
-              "test_keyboard_irq_handler", NULL);
+   ret = install_i8042_filter(intrpt_filter);
+   if (ret < 0) {
+      printk("intrpt: can't install the keyboard filter (%d)\n", ret);
+      if (threaded) {
+         stop_thread();
+         remove_proc_entry("intrpt_events", NULL);
+      }
+      remove_proc_entry("intrpt_stats", NULL);
+   }
+
+   return ret;
 }
 
 /* Cleanup */
-void cleanup_module()
+void cleanup_module(void)
 {
-   /* This is only here for completeness. It's totally irrelevant, since
-	  * we don't have a way to restore the normal keyboard interrupt so the
-		* computer is completely useless and has to be rebooted.
+   /* In shared mode, this removes only our handler and the keyboard keeps
+    * working.
     */
-   free_irq(1, NULL);
-}  
+   if (shared) {
+      free_irq(1, &Shared_Cookie);
+      remove_proc_entry("intrpt_stats", NULL);
+      return;
+   }
 
+   /* The filter is removed under the i8042 driver's lock, so once this
+    * returns it isn't running anywhere and won't be called again.  We used
+    * to have no way of giving the keyboard back - now it never went away.
+    */
+   i8042_remove_filter(intrpt_filter);
+
+   /* Nothing can schedule the bottom halves any more - wait for the ones
+    * which were already scheduled.
+    */
+   hrtimer_cancel(&Poll_Timer);
+   tasklet_kill(&Bottom_Half);
+
+   remove_proc_entry("intrpt_stats", NULL);
+
+   /* No more scancodes will come in, so the thread can go */
+   if (threaded) {
+      stop_thread();
+      remove_proc_entry("intrpt_events", NULL);
+   }
+}
@@ -9,15 +9,17 @@
 #include "chardev.h"    
 
 
+#include <stdio.h>      /* printf */
+#include <stdlib.h>     /* exit */
 #include <fcntl.h>      /* open */ 
-#include <unistd.h>     /* exit */
+#include <unistd.h>     /* close, pread */
 #include <sys/ioctl.h>  /* ioctl */
 
 
 
 /* Functions for the ioctl calls */
 
-ioctl_set_msg(int file_desc, char *message)
+void ioctl_set_msg(int file_desc, char *message)
 {
   int ret_val;
 
@@ -31,7 +33,7 @@ ioctl_set_msg(int file_desc, char *message)
 
 
 
-ioctl_get_msg(int file_desc)
+void ioctl_get_msg(int file_desc)
 {
   int ret_val;
   char message[100]; 
@@ -55,10 +57,10 @@ ioctl_get_msg(int file_desc)
 
 
 
-ioctl_get_nth_byte(int file_desc)
+void ioctl_get_nth_byte(int file_desc)
 {
   int i;
-  char c;
+  int c = 1;  /* Anything but the terminating 0 */
 
   printf("get_nth_byte message:");
 
@@ -79,11 +81,35 @@ ioctl_get_nth_byte(int file_desc)
 
 
 
+/* A system call for each byte is slow. pread gets
+ * any part of the message at once - here, length
+ * bytes from offset on. */
+void read_at(int file_desc, off_t offset, size_t length)
+{
+  char buf[100];
+  ssize_t ret_val;
+
+  if (length > sizeof(buf))
+    length = sizeof(buf);
+
+  ret_val = pread(file_desc, buf, length, offset);
+
+  if (ret_val < 0) {
+    printf ("pread failed:%d\n", (int) ret_val);
+    exit(-1);
+  }
+
+  printf("read_at %ld message:%.*s\n", (long) offset,
+         (int) ret_val, buf);
+}
+
+
+
 
 /* Main - Call the ioctl functions */
-main()
+int main(void)
 {
-  int file_desc, ret_val;
+  int file_desc;
   char *msg = "Message passed by ioctl\n";
 
   file_desc = open(DEVICE_FILE_NAME, 0);
@@ -94,9 +120,11 @@ main()
   }
 
   ioctl_get_nth_byte(file_desc);
+  read_at(file_desc, 8, 6);
   ioctl_get_msg(file_desc);
   ioctl_set_msg(file_desc, msg);
 
   close(file_desc); 
+  return 0;
 }
 
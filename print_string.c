@@ -4,66 +4,1045 @@
  */
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/sched.h>    // For current
+#include <linux/sched/signal.h> // For for_each_process
 #include <linux/tty.h>      // For the tty declarations
+#include <linux/string.h>   // For memcpy, memmove and strchr
+#include <linux/spinlock.h> // For the rate limits
+#include <linux/mutex.h>    // For the writers
+#include <linux/workqueue.h> // For the delayed flushes and the deferred printing
+#include <linux/proc_fs.h>  // For /proc/print_string
+#include <linux/seq_file.h>
+#include <linux/slab.h>     // For kmalloc
+#include <linux/percpu.h>   // For the deferred queues
+#include <linux/rcupdate.h> // For print_string_wall
+#include <linux/ktime.h>    // For the deferred latencies
+#include "compat.h"
+#include "print_string.h"
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Peter Jay Salzman");
 
 
+/* The buffered writer ************************************************************** */
+
+/* Every call of a tty driver's write goes through the driver's locking, and usually
+ * starts the hardware (or wakes up whoever reads the other side of a pty).  Printing a
+ * message used to take two of them - one for the text and one for the CR LF.  When a
+ * module has a lot to say, it's much cheaper to collect its messages in a buffer and
+ * give the driver all of them at once.  That's what a tty_writer does.  The buffer is
+ * flushed when the next message doesn't fit, when it holds writer->threshold bytes,
+ * writer->delay jiffies after the first message went in, or when the caller asks.
+ *
+ * Writing to a tty may sleep - the console driver takes a lock which does - so all of
+ * this has to run in process context.  A delayed flush is a delayed work item, which
+ * the kernel's workqueue runs in process context once the delay is up.
+ */
+
+
+/* Hand the buffer to the driver.  The driver may take less than all of it, if its own
+ * buffer is full (serial lines are slow).  What's left stays at the start of the buffer
+ * for the next flush.  Called with writer->lock held.
+ */
+static void writer_out(struct tty_writer *writer)
+{
+   int done;
+
+   if (writer->len == 0)
+      return;
+
+   /* See print_to below */
+   done = writer->tty->ops->write(writer->tty, (const unsigned char *) writer->buf,
+                                  writer->len);
+   writer->writes++;
+   if (done <= 0)
+      return;
+
+   writer->bytes += done;
+   writer->len -= done;
+   if (writer->len > 0)
+      memmove(writer->buf, writer->buf + done, writer->len);
+}
+
+
+/* Start the clock for a buffer which just stopped being empty.  Called with
+ * writer->lock held.
+ */
+static void writer_arm(struct tty_writer *writer)
+{
+   if (writer->delay && writer->len > 0 && !writer->closing)
+      mod_delayed_work(system_wq, &writer->flush_work, writer->delay);
+}
+
+
+/* The delay is up */
+static void writer_flush_work(struct work_struct *work)
+{
+   tty_writer_flush(container_of(to_delayed_work(work), struct tty_writer, flush_work));
+}
+
+
+void tty_writer_open(struct tty_writer *writer, struct tty_struct *tty,
+                     int threshold, unsigned long delay)
+{
+   memset(writer, 0, sizeof(struct tty_writer));
+   writer->tty = tty;
+   mutex_init(&writer->lock);
+   writer->threshold = (threshold > 0 && threshold < TTY_WRITER_BUF) ?
+                       threshold : TTY_WRITER_BUF;
+   writer->delay = delay;
+
+   INIT_DELAYED_WORK(&writer->flush_work, writer_flush_work);
+}
+
+
+/* How much room str takes once crlf_copy has converted it */
+static int crlf_len(const char *str)
+{
+   const char *lf;
+   int needed = strlen(str) + 2;
+
+   for (lf = strchr(str, '\n'); lf != NULL; lf = strchr(lf + 1, '\n'))
+      needed++;
+
+   return needed;
+}
+
+
+/* Copy str to dest, with every line feed turned into a carriage return and a line
+ * feed, and one more of those at the end (see print_string for why).  We copy the text
+ * between line feeds in one go, rather than a character at a time.  dest needs
+ * crlf_len(str) bytes, and isn't NULL terminated.  Returns the number of bytes copied.
+ */
+static int crlf_copy(char *dest, const char *str)
+{
+   const char *line, *lf;
+   int len = 0, run;
+
+   for (line = str; (lf = strchr(line, '\n')) != NULL; line = lf + 1) {
+      run = lf - line;
+      memcpy(dest + len, line, run);
+      memcpy(dest + len + run, "\015\012", 2);
+      len += run + 2;
+   }
+   run = strlen(line);
+   memcpy(dest + len, line, run);
+   memcpy(dest + len + run, "\015\012", 2);
+
+   return len + run + 2;
+}
+
+
+/* Add str to the buffer like crlf_copy would, but a piece at a time, handing the
+ * buffer to the driver whenever it fills up - for a message which doesn't fit in it.
+ * If the driver stops taking anything, the rest of the message is lost.  Called with
+ * writer->lock held.
+ */
+static void writer_print_long(struct tty_writer *writer, const char *str)
+{
+   const char *lf;
+   int run;
+
+   for (;;) {
+      /* Room for at least a CR LF */
+      if (TTY_WRITER_BUF - writer->len < 2) {
+         writer_out(writer);
+         if (TTY_WRITER_BUF - writer->len < 2) {
+            writer->dropped++;
+            return;
+         }
+      }
+
+      /* As much of the line as fits */
+      lf = strchrnul(str, '\n');
+      run = min_t(int, lf - str, TTY_WRITER_BUF - writer->len);
+      memcpy(writer->buf + writer->len, str, run);
+      writer->len += run;
+      str += run;
+
+      /* At the end of the line, the CR LF - once there's room for it */
+      if (str == lf && TTY_WRITER_BUF - writer->len >= 2) {
+         memcpy(writer->buf + writer->len, "\015\012", 2);
+         writer->len += 2;
+         if (*str == '\0')
+            return;
+         str++;
+      }
+   }
+}
+
+
+/* Add str, converted by crlf_copy, to the buffer */
+void tty_writer_print(struct tty_writer *writer, const char *str)
+{
+   int needed = crlf_len(str);
+
+   mutex_lock(&writer->lock);
+
+   /* Make room, if the driver will take what we have */
+   if (writer->len + needed > TTY_WRITER_BUF)
+      writer_out(writer);
+
+   if (writer->len + needed > TTY_WRITER_BUF) {
+      /* Still too big - it goes to the driver in pieces */
+      writer_print_long(writer, str);
+      writer_arm(writer);
+   } else {
+      writer->len += crlf_copy(writer->buf + writer->len, str);
+
+      /* Only the first message after a flush starts the clock */
+      if (writer->len == needed)
+         writer_arm(writer);
+   }
+   writer->messages++;
+
+   if (writer->len >= writer->threshold) {
+      writer_out(writer);
+      writer_arm(writer);
+   }
+
+   mutex_unlock(&writer->lock);
+}
+
+
+void tty_writer_flush(struct tty_writer *writer)
+{
+   mutex_lock(&writer->lock);
+   writer_out(writer);
+   writer_arm(writer);
+   mutex_unlock(&writer->lock);
+}
+
+
+void tty_writer_close(struct tty_writer *writer)
+{
+   /* After this, nobody starts the clock again */
+   mutex_lock(&writer->lock);
+   writer->closing = 1;
+   mutex_unlock(&writer->lock);
+
+   /* Wait for a flush which may be running already.  Without a delay there's never
+    * one, and no reason to wait.
+    */
+   if (writer->delay)
+      cancel_delayed_work_sync(&writer->flush_work);
+
+   /* One last try.  Whatever the driver doesn't take now is lost. */
+   mutex_lock(&writer->lock);
+   writer_out(writer);
+   mutex_unlock(&writer->lock);
+}
+
+
+EXPORT_SYMBOL(tty_writer_open);
+EXPORT_SYMBOL(tty_writer_print);
+EXPORT_SYMBOL(tty_writer_flush);
+EXPORT_SYMBOL(tty_writer_close);
+
+
+
+/* print_string ********************************************************************* */
+
+/* print_string writes through a writer as well, so the message and its CR LF reach the
+ * driver in a single call.  A writer is too big for the kernel stack, so each call
+ * gets one from kmalloc, and callers printing to different ttys never wait for each
+ * other.  Only if there's no memory do they take turns with Print_Writer.
+ */
+static struct tty_writer Print_Writer;
+static DEFINE_MUTEX(Print_Lock);
+
+
+/* A writer for one print - give it back with writer_put.  May sleep. */
+static struct tty_writer *writer_get(void)
+{
+   struct tty_writer *writer = kmalloc(sizeof(struct tty_writer), GFP_KERNEL);
+
+   if (writer != NULL)
+      return writer;
+
+   mutex_lock(&Print_Lock);
+   return &Print_Writer;
+}
+
+
+static void writer_put(struct tty_writer *writer)
+{
+   if (writer == &Print_Writer)
+      mutex_unlock(&Print_Lock);
+   else
+      kfree(writer);
+}
+
+
+/* Print the line before (if there is one), and then str, on my_tty, in one write */
+static void print_to(struct tty_struct *my_tty, char *before, char *str)
+{
+   /* my_tty->ops is a struct which holds the tty's functions, one of which (write) is
+    * used to write strings to the tty.
+    *
+    * The function's 1st parameter is the tty to write to, because the same function
+    * would normally be used for all tty's of a certain type.  The 2nd parameter is a
+    * pointer to a string, in kernel memory - it used to be able to take one from the
+    * user's memory as well, and had a parameter to say which.  The 3rd parameter is
+    * the length of the string.  writer_out above is where we call it.
+    *
+    * ttys were originally hardware devices, which (usually) strictly followed the
+    * ASCII standard.  In ASCII, to move to a new line you need two characters, a
+    * carriage return and a line feed.  On Unix, the ASCII line feed is used for both
+    * purposes - so we can't just use \n, because it wouldn't have a carriage return
+    * and the next line will start at the column right after the line feed.
+    *
+    * BTW, this is why text files are different between Unix and MS Windows.  In CP/M
+    * and its derivatives, like MS-DOS and MS Windows, the ASCII standard was strictly
+    * adhered to, and therefore a newline requirs both a LF and a CR.
+    */
+   struct tty_writer *writer = writer_get();
+
+   tty_writer_open(writer, my_tty, 0, 0);
+   if (before != NULL)
+      tty_writer_print(writer, before);
+   tty_writer_print(writer, str);
+   tty_writer_close(writer);
+   writer_put(writer);
+}
+
+
 void print_string(char *str)
 {
    struct tty_struct *my_tty;
-   my_tty = current->tty;           // The tty for the current task
+
+   /* The tty for the current task.  We used to take current->tty, but a tty can be
+    * hung up and freed under us while we write, so get_current_tty gives us a
+    * reference to it, which we have to give back.
+    */
+   my_tty = get_current_tty();
 
    /* If my_tty is NULL, the current task has no tty you can print to (this is possible,
     * for example, if it's a daemon).  If so, there's nothing we can do.
     */
-   if (my_tty != NULL) { 
-
-      /* my_tty->driver is a struct which holds the tty's functions, one of which (write)
-       * is used to write strings to the tty.  It can be used to take a string either
-       * from the user's memory segment or the kernel's memory segment.
-       *
-       * The function's 1st parameter is the tty to write to, because the same function
-       * would normally be used for all tty's of a certain type.  The 2nd parameter
-       * controls whether the function receives a string from kernel memory (false, 0) or
-       * from user memory (true, non zero).  The 3rd parameter is a pointer to a string.
-       * The 4th parameter is the length of the string.
-       */
-      (*(my_tty->driver).write)(
-         my_tty,                 // The tty itself
-         0,                      // We don't take the string from user space
-         str,                    // String
-         strlen(str));           // Length
-
-      /* ttys were originally hardware devices, which (usually) strictly followed the
-       * ASCII standard.  In ASCII, to move to a new line you need two characters, a
-       * carriage return and a line feed.  On Unix, the ASCII line feed is used for both
-       * purposes - so we can't just use \n, because it wouldn't have a carriage return
-       * and the next line will start at the column right after the line feed. 
-       *
-       * BTW, this is why text files are different between Unix and MS Windows.  In CP/M
-       * and its derivatives, like MS-DOS and MS Windows, the ASCII standard was strictly
-       * adhered to, and therefore a newline requirs both a LF and a CR.
+   if (my_tty != NULL) {
+      print_to(my_tty, NULL, str);
+      tty_kref_put(my_tty);
+   }
+}
+
+
+EXPORT_SYMBOL(print_string);
+
+
+
+/* Rate limiting ******************************************************************** */
+
+/* A slow serial console takes about a millisecond for a line, and a driver which can't
+ * keep up makes the writer wait.  If something prints in a loop when things go wrong,
+ * it can keep a CPU busy doing nothing but wait for the console.  So
+ * print_string_ratelimited gives each call site, and each tty, a token bucket: a
+ * message takes a token, and the tokens come back at a fixed rate, up to a limit.  A
+ * message which finds either bucket empty is dropped and counted.  The next message
+ * which does get through is preceded by a line saying how many were dropped, so the
+ * operator knows something is missing.
+ *
+ * The tokens are kept in 1/HZ of a message, so topping a bucket up after n jiffies is
+ * just adding n * rate.
+ */
+static int tty_rate = 20;       // Messages a second for each tty
+static int tty_burst = 10;      // Messages at once for each tty
+module_param(tty_rate, int, 0444);
+module_param(tty_burst, int, 0444);
+
+
+/* The buckets of the ttys we've printed to lately.  When a tty we haven't seen needs a
+ * bucket, it takes the one which was used least recently - a tty which was quiet that
+ * long has a full bucket anyway.  We don't hold on to the ttys - tty is only compared,
+ * never used - so the name is kept for /proc.
+ */
+#define TTY_LIMITS 16
+
+static struct tty_limit {
+   struct tty_struct *tty;
+   char name[64];                   // For /proc - tty may be gone by then
+   struct print_ratelimit bucket;
+} Tty_Limits[TTY_LIMITS];
+
+
+/* Protects the call sites' buckets as well as ours */
+static DEFINE_SPINLOCK(Limit_Lock);
+
+
+/* Total counters, for /proc/print_string */
+static unsigned long Emitted, Dropped;
+
+
+/* Top up bucket, and take a token if there is one.  Called with Limit_Lock held. */
+static int take_token(struct print_ratelimit *bucket)
+{
+   long full = (long) bucket->burst * HZ;
+   unsigned long elapsed = jiffies - bucket->last;
+
+   /* A bucket which was left alone long enough is full - and multiplying a long time
+    * by the rate could overflow
+    */
+   if (!bucket->started || elapsed >= (unsigned long) full) {
+      bucket->tokens = full;
+      bucket->started = 1;
+   } else {
+      bucket->tokens += (long) elapsed * bucket->rate;
+      if (bucket->tokens > full)
+         bucket->tokens = full;
+   }
+   bucket->last = jiffies;
+
+   if (bucket->tokens < HZ)
+      return 0;
+
+   bucket->tokens -= HZ;
+   return 1;
+}
+
+
+/* The bucket for my_tty.  Called with Limit_Lock held. */
+static struct print_ratelimit *tty_bucket(struct tty_struct *my_tty)
+{
+   struct tty_limit *limit, *oldest = NULL, *empty = NULL;
+   int i;
+
+   for (i = 0; i < TTY_LIMITS; i++) {
+      limit = &Tty_Limits[i];
+      if (limit->tty == my_tty)
+         return &limit->bucket;
+
+      /* An empty slot is used before any tty's bucket is thrown away.  Only the
+       * occupied ones have a time worth comparing - an empty one's last is 0, which
+       * jiffies may well be before.
        */
-      (*(my_tty->driver).write)(my_tty, 0, "\015\012", 2);
+      if (limit->tty == NULL) {
+         if (empty == NULL)
+            empty = limit;
+      } else if (oldest == NULL ||
+                 time_before(limit->bucket.last, oldest->bucket.last))
+         oldest = limit;
    }
+
+   if (empty != NULL)
+      oldest = empty;
+
+   memset(oldest, 0, sizeof(struct tty_limit));
+   oldest->tty = my_tty;
+   strscpy(oldest->name, tty_name(my_tty), sizeof(oldest->name));
+   oldest->bucket.rate = tty_rate;
+   oldest->bucket.burst = tty_burst;
+
+   return &oldest->bucket;
 }
 
 
-int print_string_init(void)
+void print_string_ratelimited(struct print_ratelimit *site, char *str)
 {
+   struct tty_struct *my_tty = get_current_tty();
+   struct print_ratelimit *bucket;
+   unsigned long suppressed;
+   char summary[64];
+   int pass;
+
+   if (my_tty == NULL)
+      return;
+
+   spin_lock(&Limit_Lock);
+   bucket = tty_bucket(my_tty);
+
+   /* Both have to have a token - but don't take the tty's if the site has none */
+   pass = take_token(site) && take_token(bucket);
+   if (!pass) {
+      site->dropped++;
+      site->suppressed++;
+      bucket->dropped++;
+      bucket->suppressed++;
+      Dropped++;
+      spin_unlock(&Limit_Lock);
+      tty_kref_put(my_tty);
+      return;
+   }
+
+   /* Report the larger of the two - the tty's count includes messages from other
+    * sites, the site's messages it dropped on other ttys.
+    */
+   suppressed = site->suppressed > bucket->suppressed ?
+                site->suppressed : bucket->suppressed;
+   site->suppressed = 0;
+   bucket->suppressed = 0;
+   site->emitted++;
+   bucket->emitted++;
+   Emitted++;
+   spin_unlock(&Limit_Lock);
+
+   if (suppressed) {
+      sprintf(summary, "%lu messages suppressed", suppressed);
+      print_to(my_tty, summary, str);
+   } else
+      print_to(my_tty, NULL, str);
+
+   tty_kref_put(my_tty);
+}
+
+
+EXPORT_SYMBOL(print_string_ratelimited);
+
+
+static void async_show(struct seq_file *m);
+
+
+/* Counters, for /proc/print_string */
+static unsigned long Broadcasts, Broadcast_Writes, Broadcast_Failures;
+static int Subscriber_Count;
+
+
+/* Put the counters into /proc/print_string - the totals, and those of the ttys we have
+ * buckets for, and then the state of the deferred queues.  A call site's counters are
+ * in its own struct print_ratelimit.
+ */
+static int limits_show(struct seq_file *m, void *v)
+{
+   struct tty_limit *limit;
+   int i;
+
+   spin_lock(&Limit_Lock);
+
+   seq_printf(m, "emitted %lu\ndropped %lu\n", Emitted, Dropped);
+
+   seq_puts(m, "tty          emitted    dropped\n");
+   for (i = 0; i < TTY_LIMITS; i++) {
+      limit = &Tty_Limits[i];
+      if (limit->tty == NULL)
+         continue;
+      seq_printf(m, "%-8s %10lu %10lu\n",
+                 limit->name, limit->bucket.emitted, limit->bucket.dropped);
+   }
+
+   spin_unlock(&Limit_Lock);
+
+   async_show(m);
+
+   seq_printf(m, "broadcasts       %lu\n"
+                 "broadcast writes %lu\n"
+                 "broadcast failed %lu\n"
+                 "subscribers      %d\n",
+              Broadcasts, Broadcast_Writes, Broadcast_Failures, Subscriber_Count);
+
+   return 0;
+}
+
+
+
+/* Deferred printing *************************************************************** */
+
+/* Writing to a tty may sleep, and takes as long as the tty does, so print_string can't
+ * be used with interrupts off, in an interrupt handler, or anywhere we can't afford to
+ * wait for a slow terminal.  print_string_async only copies the message into a queue
+ * and returns, and a worker (a work item on the kernel's workqueue) prints it later.
+ *
+ * Each CPU has a queue of its own - a ring, like the ones in syscall.c, with one
+ * producer and one consumer, so it needs no lock.  The producer is whatever runs on
+ * that CPU; we turn interrupts off while we fill a slot, so a handler which prints
+ * can't get in the middle of it.  The consumer is the worker.
+ *
+ * head - advanced by the producer, for each message queued
+ * tail - advanced by the worker, for each message printed
+ *
+ * A message waits with the tty it's for.  ttys are reference counted, and we hold a
+ * reference from the moment a message is queued until it's printed, so the tty can't go
+ * away under the worker, even if the caller closes it.
+ */
+#define ASYNC_SLOTS 32              // Must be a power of two
+#define ASYNC_SLOT(i) ((i) & (ASYNC_SLOTS - 1))
+
+struct async_msg {
+   struct tty_struct *tty;
+   u64 queued;                      // When print_string_async was called, in ns
+   char text[PRINT_ASYNC_LEN];
+};
+
+struct async_queue {
+   unsigned int head;
+   unsigned long dropped;           // Messages lost, the queue was full
+   unsigned long max_depth;         // Most messages waiting at once
+   unsigned int tail ____cacheline_aligned;
+   struct async_msg msgs[ASYNC_SLOTS];
+};
+
+static struct async_queue __percpu *Async_Queues;
+
+
+/* The worker prints with a writer of its own.  A work item never runs twice at once,
+ * so it needs no lock, and printing from the queues never waits for print_string.
+ */
+static struct tty_writer Async_Writer;
+
+/* Counters only the worker changes.  Latencies are in nanoseconds, from
+ * print_string_async to the driver taking the message - messages which go to the
+ * driver together are all counted when the last of them is written.
+ */
+static unsigned long Async_Delivered;
+static u64 Async_Latency_Sum, Async_Latency_Max;
+
+
+static void async_worker(struct work_struct *unused);
+
+static DECLARE_WORK(Async_Work, async_worker);
+
+
+int print_string_async(struct tty_struct *tty, const char *str)
+{
+   struct async_queue *queue;
+   struct async_msg *msg;
+   unsigned long flags, depth;
+
+   /* Either way, we get a reference of our own, which the worker gives back.  In an
+    * interrupt, current is whatever task we interrupted, so its tty is nobody's
+    * business - the caller has to say which tty it means.
+    */
+   if (tty == NULL && !in_task())
+      return -EINVAL;
+   if (tty == NULL)
+      tty = get_current_tty();
+   else
+      tty = tty_kref_get(tty);
+   if (tty == NULL)
+      return -ENODEV;
+
+   local_irq_save(flags);
+   queue = this_cpu_ptr(Async_Queues);
+
+   depth = queue->head - queue->tail;
+   if (depth >= ASYNC_SLOTS) {
+      queue->dropped++;
+      local_irq_restore(flags);
+      tty_kref_put(tty);
+      return -ENOSPC;
+   }
+   if (depth + 1 > queue->max_depth)
+      queue->max_depth = depth + 1;
+
+   msg = &queue->msgs[ASYNC_SLOT(queue->head)];
+   msg->tty = tty;
+   msg->queued = ktime_get_ns();
+   strscpy(msg->text, str, PRINT_ASYNC_LEN);
+
+   /* The message has to be in memory before the worker can see the new head */
+   smp_wmb();
+   queue->head++;
+
+   local_irq_restore(flags);
+
+   /* If the worker is already scheduled, this does nothing */
+   schedule_work(&Async_Work);
+
+   return 0;
+}
+
+
+EXPORT_SYMBOL(print_string_async);
+
+
+/* Print what's in the queues.  Messages which follow each other in a queue and are
+ * for the same tty go through one writer, so they reach the driver together.
+ */
+static void async_worker(struct work_struct *unused)
+{
+   struct async_queue *queue;
+   struct async_msg *msg;
+   struct tty_struct *tty;
+   u64 queued[ASYNC_SLOTS], now, latency;
+   unsigned int head, n, i;
+   int cpu;
+
+   for_each_possible_cpu(cpu) {
+      queue = per_cpu_ptr(Async_Queues, cpu);
+      head = queue->head;
+
+      /* Don't look at a message before we've seen the head which covers it */
+      smp_rmb();
+
+      while (queue->tail != head) {
+         /* A reference for the writer, which outlives the messages' */
+         tty = tty_kref_get(queue->msgs[ASYNC_SLOT(queue->tail)].tty);
+         tty_writer_open(&Async_Writer, tty, 0, 0);
+
+         /* There are never more than ASYNC_SLOTS messages in the run */
+         n = 0;
+         while (queue->tail != head &&
+                (msg = &queue->msgs[ASYNC_SLOT(queue->tail)])->tty == tty) {
+            tty_writer_print(&Async_Writer, msg->text);
+            queued[n++] = msg->queued;
+
+            /* We must be done with the slot before it can be reused */
+            smp_mb();
+            queue->tail++;
+            tty_kref_put(tty);
+         }
+
+         /* The writer may hold on to the run until it's closed, so that's when the
+          * driver has it all
+          */
+         tty_writer_close(&Async_Writer);
+         tty_kref_put(tty);
+
+         now = ktime_get_ns();
+         for (i = 0; i < n; i++) {
+            latency = now - queued[i];
+            Async_Latency_Sum += latency;
+            if (latency > Async_Latency_Max)
+               Async_Latency_Max = latency;
+         }
+         Async_Delivered += n;
+      }
+   }
+}
+
+
+/* Wait until everything queued so far has been printed */
+void print_string_async_flush(void)
+{
+   flush_work(&Async_Work);
+}
+
+
+EXPORT_SYMBOL(print_string_async_flush);
+
+
+static void async_free(void)
+{
+   free_percpu(Async_Queues);
+   Async_Queues = NULL;
+}
+
+
+/* The deferred part of /proc/print_string */
+static void async_show(struct seq_file *m)
+{
+   struct async_queue *queue;
+   int cpu;
+
+   seq_printf(m, "async delivered %lu\n"
+                 "async latency    %llu average, %llu max (ns)\n",
+              Async_Delivered,
+              Async_Delivered ? div64_u64(Async_Latency_Sum, Async_Delivered) : 0ULL,
+              Async_Latency_Max);
+
+   seq_puts(m, "cpu      depth  max depth    dropped\n");
+   for_each_possible_cpu(cpu) {
+      queue = per_cpu_ptr(Async_Queues, cpu);
+      seq_printf(m, "%3d %10u %10lu %10lu\n",
+                 cpu, queue->head - queue->tail, queue->max_depth, queue->dropped);
+   }
+}
+
+
+
+/* Broadcasting ******************************************************************** */
+
+/* To tell every terminal something, we could call print_string from a task on each of
+ * them - which we can't arrange - or format the message once for each.  Instead, the
+ * message is formatted and converted once, into one buffer, and that same buffer is
+ * given to the driver of each tty.  A tty which fails, or takes only part of the
+ * message, is counted, and doesn't stop the others from getting it.
+ *
+ * The ttys come from the caller, from every process which has a terminal
+ * (print_string_wall), or from a list of ttys which subscribed
+ * (print_string_subscribe and print_string_notify).
+ *
+ * Every tty we find ourselves is held (with tty_kref_get) from the moment we find it
+ * until we're done with it, so it can't be freed while we write, and we don't need
+ * the big kernel lock we used to take.
+ */
+#define BROADCAST_LEN 512           // The longest formatted message
+#define BROADCAST_TTYS 64           // The most ttys print_string_wall and the list reach
+
+struct broadcast {
+   char text[BROADCAST_LEN];
+   char out[2 * BROADCAST_LEN + 2]; // Every character might be a line feed
+   struct tty_struct *ttys[BROADCAST_TTYS];
+};
+
+
+/* The subscribers, protected by Subscriber_Lock */
+static struct tty_struct *Subscribers[BROADCAST_TTYS];
+static DEFINE_MUTEX(Subscriber_Lock);
+
+
+static DEFINE_SPINLOCK(Broadcast_Lock);
+
+
+/* Format the message into b->out.  Returns its length. */
+static int broadcast_format(struct broadcast *b, const char *fmt, va_list args)
+{
+   vsnprintf(b->text, BROADCAST_LEN, fmt, args);
+   return crlf_copy(b->out, b->text);
+}
+
+
+/* Write b->out to each of the count ttys.  Returns how many took all of it. */
+static int broadcast_out(struct broadcast *b, int len,
+                         struct tty_struct **ttys, int count)
+{
+   int i, done, delivered = 0;
+
+   for (i = 0; i < count; i++) {
+      done = ttys[i]->ops->write(ttys[i], (const unsigned char *) b->out, len);
+      if (done == len)
+         delivered++;
+   }
+
+   spin_lock(&Broadcast_Lock);
+   Broadcasts++;
+   Broadcast_Writes += count;
+   Broadcast_Failures += count - delivered;
+   spin_unlock(&Broadcast_Lock);
+
+   return delivered;
+}
+
+
+/* Print the message made from fmt on each of the count ttys in ttys, which the caller
+ * makes sure stay open.  Returns how many got all of it.  May sleep.
+ */
+int print_string_broadcast(struct tty_struct **ttys, int count, const char *fmt, ...)
+{
+   struct broadcast *b;
+   va_list args;
+   int len, delivered;
+
+   b = kmalloc(sizeof(struct broadcast), GFP_KERNEL);
+   if (b == NULL)
+      return -ENOMEM;
+
+   va_start(args, fmt);
+   len = broadcast_format(b, fmt, args);
+   va_end(args);
+
+   delivered = broadcast_out(b, len, ttys, count);
+
+   kfree(b);
+   return delivered;
+}
+
+
+EXPORT_SYMBOL(print_string_broadcast);
+
+
+/* The controlling terminal of p, held, or NULL.  It lives in p's signal structure,
+ * which p's signal lock protects.  We're called under rcu_read_lock, and p may be
+ * exiting, in which case p->sighand can go away - that's how we find out (this is what
+ * the kernel's lock_task_sighand does, but it isn't there for modules).
+ */
+static struct tty_struct *task_tty(struct task_struct *p)
+{
+   struct sighand_struct *sighand;
+   struct tty_struct *tty = NULL;
+   unsigned long flags;
+
+   sighand = rcu_dereference(p->sighand);
+   if (sighand == NULL)
+      return NULL;
+
+   spin_lock_irqsave(&sighand->siglock, flags);
+   if (sighand == rcu_access_pointer(p->sighand))
+      tty = tty_kref_get(p->signal->tty);
+   spin_unlock_irqrestore(&sighand->siglock, flags);
+
+   return tty;
+}
+
+
+/* Print the message on the terminal of every process which has one, once for each
+ * terminal.  Returns how many got all of it.  May sleep.
+ */
+int print_string_wall(const char *fmt, ...)
+{
+   struct broadcast *b;
+   struct task_struct *p;
+   struct tty_struct *tty;
+   va_list args;
+   int len, count = 0, delivered, i;
+
+   b = kmalloc(sizeof(struct broadcast), GFP_KERNEL);
+   if (b == NULL)
+      return -ENOMEM;
+
+   va_start(args, fmt);
+   len = broadcast_format(b, fmt, args);
+   va_end(args);
+
+   /* The process list used to be walked under tasklist_lock, which modules can't take
+    * any more.  Under RCU we may miss a process which is just starting, or see one
+    * which is just leaving - for a broadcast, that's fine.
+    */
+   rcu_read_lock();
+   for_each_process(p) {
+      tty = task_tty(p);
+      if (tty == NULL)
+         continue;
+
+      /* Many processes share a terminal - a shell and everything it runs */
+      for (i = 0; i < count; i++)
+         if (b->ttys[i] == tty)
+            break;
+      if (i < count || count == BROADCAST_TTYS) {
+         tty_kref_put(tty);
+         if (i < count)
+            continue;
+         break;
+      }
+
+      b->ttys[count++] = tty;
+   }
+   rcu_read_unlock();
+
+   delivered = broadcast_out(b, len, b->ttys, count);
+
+   for (i = 0; i < count; i++)
+      tty_kref_put(b->ttys[i]);
+
+   kfree(b);
+   return delivered;
+}
+
+
+EXPORT_SYMBOL(print_string_wall);
+
+
+/* Add tty to the subscribers (the current task's, if tty is NULL).  Returns 0,
+ * -ENODEV if there's no tty, or -ENOSPC if the list is full.  The tty stays on the
+ * list until print_string_unsubscribe.  May sleep.
+ */
+int print_string_subscribe(struct tty_struct *tty)
+{
+   int i;
+
+   /* Either way, we get a reference of our own, which the list keeps */
+   if (tty == NULL)
+      tty = get_current_tty();
+   else
+      tty = tty_kref_get(tty);
+   if (tty == NULL)
+      return -ENODEV;
+
+   mutex_lock(&Subscriber_Lock);
+
+   for (i = 0; i < Subscriber_Count; i++)
+      if (Subscribers[i] == tty) {
+         mutex_unlock(&Subscriber_Lock);
+         tty_kref_put(tty);
+         return 0;
+      }
+
+   if (Subscriber_Count == BROADCAST_TTYS) {
+      mutex_unlock(&Subscriber_Lock);
+      tty_kref_put(tty);
+      return -ENOSPC;
+   }
+   Subscribers[Subscriber_Count++] = tty;
+
+   mutex_unlock(&Subscriber_Lock);
+   return 0;
+}
+
+
+void print_string_unsubscribe(struct tty_struct *tty)
+{
+   struct tty_struct *mine = NULL;
+   int i;
+
+   if (tty == NULL)
+      tty = mine = get_current_tty();
+
+   mutex_lock(&Subscriber_Lock);
+
+   for (i = 0; i < Subscriber_Count; i++)
+      if (tty != NULL && Subscribers[i] == tty) {
+         tty_kref_put(tty);
+         Subscribers[i] = Subscribers[--Subscriber_Count];
+         break;
+      }
+
+   mutex_unlock(&Subscriber_Lock);
+
+   /* tty_kref_put takes NULL as well */
+   tty_kref_put(mine);
+}
+
+
+/* Print the message on every subscriber.  Returns how many got all of it.  May
+ * sleep.
+ */
+int print_string_notify(const char *fmt, ...)
+{
+   struct broadcast *b;
+   va_list args;
+   int len, delivered;
+
+   b = kmalloc(sizeof(struct broadcast), GFP_KERNEL);
+   if (b == NULL)
+      return -ENOMEM;
+
+   va_start(args, fmt);
+   len = broadcast_format(b, fmt, args);
+   va_end(args);
+
+   /* Holding the lock keeps the subscribers from leaving while we write */
+   mutex_lock(&Subscriber_Lock);
+   delivered = broadcast_out(b, len, Subscribers, Subscriber_Count);
+   mutex_unlock(&Subscriber_Lock);
+
+   kfree(b);
+   return delivered;
+}
+
+
+EXPORT_SYMBOL(print_string_subscribe);
+EXPORT_SYMBOL(print_string_unsubscribe);
+EXPORT_SYMBOL(print_string_notify);
+
+
+
+static int __init print_string_init(void)
+{
+   if (tty_rate < 1 || tty_burst < 1)
+      return -EINVAL;
+
+   /* Zeroed, like everything alloc_percpu gives */
+   Async_Queues = alloc_percpu(struct async_queue);
+   if (Async_Queues == NULL)
+      return -ENOMEM;
+
+   if (proc_create_single("print_string", 0444, NULL, limits_show) == NULL) {
+      async_free();
+      return -ENOMEM;
+   }
+
    print_string("The module has been inserted.  Hello world!");
    return 0;
 }
 
 
-void print_string_exit(void)
+static void __exit print_string_exit(void)
 {
    print_string("The module has been removed.  Farewell world!");
-}  
+
+   remove_proc_entry("print_string", NULL);
+
+   /* Nobody can queue a message once we're being removed - they'd have to call us, and
+    * having our symbols makes them depend on us.  Print what's left.
+    */
+   print_string_async_flush();
+   async_free();
+
+   /* Subscribers are the business of other modules, which depend on us, so they're
+    * gone by now - but if one forgot to unsubscribe, let go of its tty
+    */
+   while (Subscriber_Count > 0)
+      tty_kref_put(Subscribers[--Subscriber_Count]);
+}
 
 
 module_init(print_string_init);
 module_exit(print_string_exit);
-
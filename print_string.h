@@ -0,0 +1,129 @@
+/*  print_string.h - the declarations other modules need to print to a tty through
+ *     print_string.ko.
+ *
+ *  The writer structure is here, and not hidden in print_string.c, so that the caller
+ *  can allocate it wherever it likes - statically, in its own structures, etc.
+ */
+
+#ifndef PRINT_STRING_H
+#define PRINT_STRING_H
+
+#include <linux/tty.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+
+
+/* How much output a writer holds before it has to go to the tty */
+#define TTY_WRITER_BUF 1024
+
+
+/* A buffered writer for one tty.  Messages are collected in buf, with their line feeds
+ * already turned into CR LF, and handed to the tty driver in as few calls as possible.
+ * Everything in it is private to print_string.c, except the counters, which the caller
+ * may read.
+ */
+struct tty_writer {
+   struct tty_struct *tty;
+   struct mutex lock;                  // Protects everything below
+   char buf[TTY_WRITER_BUF];
+   int len;                            // Bytes in buf
+   int threshold;                      // Flush once len reaches this
+   unsigned long delay;                // Flush this many jiffies after buf stops being empty
+   struct delayed_work flush_work;     // Runs delay jiffies after buf stops being empty
+   int closing;
+
+   /* Counters */
+   unsigned long messages;             // Messages printed
+   unsigned long writes;               // Calls of the driver's write
+   unsigned long bytes;                // Bytes the driver took
+   unsigned long dropped;              // Messages the tty wouldn't take all of
+};
+
+
+/* Start writing to tty.  Output is flushed once threshold bytes have collected (0 for
+ * TTY_WRITER_BUF), or delay jiffies after the first of them (0 for never).
+ */
+extern void tty_writer_open(struct tty_writer *writer, struct tty_struct *tty,
+                            int threshold, unsigned long delay);
+
+/* Add str, and a line break after it, to the output.  A message too long for the
+ * buffer goes to the tty in pieces.  May sleep.
+ */
+extern void tty_writer_print(struct tty_writer *writer, const char *str);
+
+/* Write out whatever the tty will take now.  May sleep. */
+extern void tty_writer_flush(struct tty_writer *writer);
+
+/* Flush, and stop writing.  After this the tty may go away.  May sleep. */
+extern void tty_writer_close(struct tty_writer *writer);
+
+
+/* Print str on the current task's tty, at once.  May sleep. */
+extern void print_string(char *str);
+
+
+/* A call site's token bucket, for print_string_ratelimited.  Each message takes a token,
+ * and the bucket gets rate tokens a second back, up to burst.  Define one with
+ * DEFINE_PRINT_RATELIMIT next to the print_string_ratelimited call it's for, and don't
+ * touch it except to read the counters.
+ */
+struct print_ratelimit {
+   int rate;                           // Messages a second
+   int burst;                          // Messages at once
+   long tokens;                        // In 1/HZ of a message
+   unsigned long last;                 // jiffies when tokens was last topped up
+   int started;
+
+   /* Counters */
+   unsigned long emitted;              // Messages printed
+   unsigned long dropped;              // Messages suppressed, in all
+   unsigned long suppressed;           // Messages suppressed since the last summary
+};
+
+#define DEFINE_PRINT_RATELIMIT(name, rate, burst) \
+   struct print_ratelimit name = { rate, burst, 0, 0, 0, 0, 0, 0 }
+
+
+/* Like print_string, but only if neither site nor the current task's tty is over its
+ * limit.  Otherwise the message is dropped, and once messages get through again, a line
+ * saying how many were suppressed comes before them.  May sleep.
+ */
+extern void print_string_ratelimited(struct print_ratelimit *site, char *str);
+
+
+/* Queue str for tty (the current task's, if tty is NULL), and return at once.  A
+ * worker prints it later, in process context.  Never sleeps, so it may be called with
+ * interrupts off or from an interrupt handler - but there, the task is just whoever
+ * was interrupted, so tty has to be given.  The tty is held until the message is
+ * printed, so it may be closed in between.  Returns 0, -EINVAL for a NULL tty outside
+ * a task, -ENODEV if there's no tty, or -ENOSPC if the queue is full and the message
+ * was dropped.  Messages longer than PRINT_ASYNC_LEN - 1 are cut.
+ */
+#define PRINT_ASYNC_LEN 104
+
+extern int print_string_async(struct tty_struct *tty, const char *str);
+
+/* Wait until everything print_string_async queued so far is printed.  May sleep. */
+extern void print_string_async_flush(void);
+
+
+/* Print the message made from fmt, formatted once, on each of the count ttys in ttys,
+ * which the caller makes sure stay open.  The message is cut at 511 characters.  A tty
+ * which fails doesn't keep the others from getting it.  Returns how many ttys got the
+ * whole message, or -ENOMEM.  May sleep.
+ */
+extern int print_string_broadcast(struct tty_struct **ttys, int count, const char *fmt, ...);
+
+/* Same, for the terminal of every process which has one */
+extern int print_string_wall(const char *fmt, ...);
+
+/* Same, for the ttys on the subscriber list, which print_string_subscribe adds to (the
+ * current task's tty, if tty is NULL) and print_string_unsubscribe removes from.  A tty
+ * is held while it's on the list.
+ */
+extern int print_string_subscribe(struct tty_struct *tty);
+extern void print_string_unsubscribe(struct tty_struct *tty);
+extern int print_string_notify(const char *fmt, ...);
+
+
+#endif
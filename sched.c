@@ -5,141 +5,85 @@
  *  06/20/2006 - Updated by Rodrigo Rubira Branco <rodrigo@kernelhacking.com>
  */
 
-/* Kernel Programming */
-#define MODULE
-#define LINUX
-#define __KERNEL__
-
 /* The necessary header files */
 
 /* Standard in kernel modules */
 #include <linux/kernel.h>                   /* We're doing kernel work */
 #include <linux/module.h>                   /* Specifically, a module */
 
-/* Deal with CONFIG_MODVERSIONS */
-#if CONFIG_MODVERSIONS==1
-#define MODVERSIONS
-#include <linux/modversions.h>
-#endif        
-
 /* Necessary because we use the proc fs */
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 
-/* We scheduale tasks here */
-#include <linux/tqueue.h>
-
-/* We also need the ability to put ourselves to sleep and wake up later */
-#include <linux/sched.h>
+/* We scheduale our function here */
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 
-/* In 2.2.3 /usr/include/linux/version.h includes a macro for this, but
- * 2.0.35 doesn't - so I add it here if necessary.
- */
-#ifndef KERNEL_VERSION
-#define KERNEL_VERSION(a,b,c) ((a)*65536+(b)*256+(c))
-#endif
+/* What changed between the kernels we build for */
+#include "compat.h"
 
 /* The number of times the timer interrupt has been called so far */
 static int TimerIntrpt = 0;
 
-/* This is used by cleanup, to prevent the module from being unloaded while
- * intrpt_routine is still in the task queue
+/* We used to put ourselves in tq_timer, a task queue the kernel ran on every
+ * timer interrupt.  It's gone - there isn't even a timer interrupt on every
+ * tick any more, when a CPU has nothing to do.  Instead we ask for a high
+ * resolution timer which goes off once a tick (TICK_NSEC nanoseconds), and
+ * comes back by itself.
  */
-static DECLARE_WAIT_QUEUE_HEAD(WaitQ);
-int waitq=0;
-
-static void intrpt_routine(void *);
-
-/* The task queue structure for this task, from tqueue.h */
-static struct tq_struct Task = {
-   routine: (void (*)(void *)) intrpt_routine, /* The function to run */
-   data: NULL            /* The void* parameter for that function */
-};
+static struct hrtimer Timer;
 
-/* This function will be called on every timer interrupt. Notice the void*
- * pointer - task functions can be used for more than one purpose, each time 
- * getting a different parameter.
+/* This function will be called on every tick.  It runs in interrupt
+ * context, like the task queue routine did.
  */
-static void intrpt_routine(void *irrelevant)
+static enum hrtimer_restart intrpt_routine(struct hrtimer *timer)
 {
    /* Increment the counter */
    TimerIntrpt++;
 
-   /* If cleanup wants us to die */
-   if (waitq) 
-      wake_up(&WaitQ);               /* Now cleanup_module can return */
-   else
-      /* Put ourselves back in the task queue */
-      queue_task(&Task, &tq_timer);  
+   /* Put ourselves back, for the next tick.  Forwarding from now rather
+    * than adding to the last expiry means a late run doesn't make us run
+    * several times in a row to catch up.
+    */
+   hrtimer_forward_now(timer, ns_to_ktime(TICK_NSEC));
+   return HRTIMER_RESTART;
 }
 
-/* Put data into the proc fs file. */
-int procfile_read(char *buffer, 
-                  char **buffer_location, off_t offset, 
-                  int buffer_length, int *eof, void *data)
+/* Put data into the proc fs file.  The seq_file code gives the reader as
+ * much of it as it asks for, and takes care of the offset.
+ */
+static int procfile_show(struct seq_file *m, void *v)
 {
-   int len;  /* The number of bytes actually used */
-
-   /* It's static so it will still be in memory when we leave this function
-    */
-   static char my_buffer[80];  
-
-   static int count = 1;
-
-   /* We give all of our information in one go, so if the anybody asks us
-    * if we have more information the answer should always be no. 
-    */
-   if (offset > 0)
-      return 0;
-
-   /* Fill the buffer and get its length */
-   len = sprintf(my_buffer, "Timer called %d times so far\n", TimerIntrpt);
-   count++;
-
-   /* Tell the function which called us where the buffer is */
-   *buffer_location = my_buffer;
-
-   /* Return the length */
-   return len;
+   seq_printf(m, "Timer called %d times so far\n", TimerIntrpt);
+   return 0;
 }
 
-/* Proc structure pointer */
-struct proc_dir_entry *Our_Proc_File;
-
 /* Initialize the module - register the proc file */
-int init_module()
+int init_module(void)
 {
-   /* Put the task in the tq_timer task queue, so it will be executed at
-    * next timer interrupt
-    */
-   queue_task(&Task, &tq_timer);
-
-   /* Success if proc_register_dynamic is a success, failure otherwise */
-   Our_Proc_File=create_proc_read_entry("sched", 0444, NULL, procfile_read, NULL);
+   if (proc_create_single("sched", 0444, NULL, procfile_show) == NULL)
+      return -ENOMEM;
 
-   if ( Our_Proc_File == NULL )
-	return -ENOMEM;
-   else
-	return 0;
+   /* Start the timer, so it will go off on the next tick */
+   hrtimer_setup(&Timer, intrpt_routine, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   hrtimer_start(&Timer, ns_to_ktime(TICK_NSEC), HRTIMER_MODE_REL);
 
+   return 0;
 }
 
 /* Cleanup */
-void cleanup_module()
+void cleanup_module(void)
 {
    /* Unregister our /proc file */
    remove_proc_entry("sched", NULL);
-  
-   /* Sleep until intrpt_routine is called one last time. This is necessary,
-    * because otherwise we'll deallocate the memory holding intrpt_routine
-    * and Task while tq_timer still references them.  Notice that here we
-    * don't allow signals to interrupt us. 
-    *
-    * Since WaitQ is now not NULL, this automatically tells the interrupt
-    * routine it's time to die.
+
+   /* We used to sleep until intrpt_routine was called one last time, so we
+    * wouldn't deallocate the memory holding it while tq_timer still
+    * referenced it.  hrtimer_cancel does that for us - it waits for a
+    * running intrpt_routine to finish, and makes sure it isn't called
+    * again.
     */
-   waitq=1;
-   sleep_on(&WaitQ);
-}  
+   hrtimer_cancel(&Timer);
+}
 
 MODULE_LICENSE("GPL");
-
@@ -5,29 +5,22 @@
 #include <linux/kernel.h>                   /* We're doing kernel work */
 #include <linux/module.h>                   /* Specifically, a module */
 
-/* Deal with CONFIG_MODVERSIONS */
-#if CONFIG_MODVERSIONS==1
-#define MODVERSIONS
-#include <linux/modversions.h>
-#endif        
-
 /* Necessary because we use proc fs */
 #include <linux/proc_fs.h>
 
 /* For putting processes to sleep and waking them up */
 #include <linux/sched.h>
-#include <linux/wrapper.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
 
-/* In 2.2.3 /usr/include/linux/version.h includes a macro for this, but 2.0.35
- * doesn't - so I add it here if necessary.
- */
-#ifndef KERNEL_VERSION
-#define KERNEL_VERSION(a,b,c) ((a)*65536+(b)*256+(c))
-#endif
+/* For copy_to_user, copy_from_user and current's credentials */
+#include <linux/uaccess.h>
+#include <linux/cred.h>
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-#include <asm/uaccess.h>                    /* for get_user and put_user */
-#endif
+/* What changed between the kernels we build for */
+#include "compat.h"
+
+MODULE_LICENSE("GPL");
 
 /* The module's file functions */
 
@@ -41,311 +34,192 @@ static char Message[MESSAGE_LENGTH];
  * output provisions - we have to use a standard read function, which is this
  * function
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
 static ssize_t module_output (
    struct file *file,                      /* The file read */
-   char *buf,           /* The buffer to put data to (in the user segment) */
+   char __user *buf,    /* The buffer to put data to (in the user segment) */
    size_t len,                             /* The length of the buffer */
-   loff_t *offset)                         /* Offset in the file - ignore */
-#else
-static int module_output (
-   struct inode *inode,                    /* The inode read */
-   struct file *file,                      /* The file read */
-   char *buf,           /* The buffer to put data to (in the user segment) */
-   int len)                                /* The length of the buffer */
-#endif
+   loff_t *offset)                         /* Offset in the file */
 {
-   static int finished = 0;
-   int i;
    char message[MESSAGE_LENGTH+30];
-
-   /* Return 0 to signify end of file - that we have nothing more to say at this
-    * point.
-    */
-   if (finished) {
-      finished = 0;
-      return 0;
-   }
+   int length;
 
    /* If you don't understand this by now, you're hopeless as a kernel
-    * programmer.
+    * programmer.  (See procfs.c for why the offset replaced the "finished"
+    * flag.)
     */
-   sprintf(message, "Last input:%s\n", Message);
-   for (i = 0; i < len && message[i]; i++) 
-      put_user(message[i], buf+i);
+   length = sprintf(message, "Last input:%s\n", Message);
 
-   finished = 1;
-   return i;                            /* Return the number of bytes "read" */
+   return simple_read_from_buffer(buf, len, offset, message, length);
 }
 
 /* This function receives input from the user when the user writes to the /proc
  * file.
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
 static ssize_t module_input (
    struct file *file,                     /* The file itself */
-   const char *buf,                       /* The buffer with input */
+   const char __user *buf,                /* The buffer with input */
    size_t length,                         /* The buffer's length */
    loff_t *offset)                        /* offset to file - ignore */
-#else
-static int module_input (
-   struct inode *inode,                   /* The file's inode */
-   struct file *file,                     /* The file itself */
-   const char *buf,                       /* The buffer with the input */
-   int length)                            /* The buffer's length */
-#endif
 {
-   int i;
+   size_t i = length < MESSAGE_LENGTH-1 ? length : MESSAGE_LENGTH-1;
 
    /* Put the input into Message, where module_output will later be able to use
     * it
     */
-   for(i = 0; i < MESSAGE_LENGTH-1 && i < length; i++)
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-      get_user(Message[i], buf+i);
-#else
-      Message[i] = get_user(buf+i);
-#endif
+   if (copy_from_user(Message, buf, i))
+      return -EFAULT;
+
    /* we want a standard, zero terminated string */
-   Message[i] = '\0';  
-  
+   Message[i] = '\0';
+
    /* We need to return the number of input characters used */
    return i;
 }
 
 /* 1 if the file is currently open by somebody */
-int Already_Open = 0;
+static atomic_t Already_Open = ATOMIC_INIT(0);
+
+/* Set by cleanup_module, so nobody waits for a file which is going away */
+static int Unloading = 0;
 
 /* Queue of processes who want our file */
-static struct wait_queue *WaitQ = NULL;
+static DECLARE_WAIT_QUEUE_HEAD(WaitQ);
+
+/* This function decides whether to allow an operation (return zero) or not
+ * allow it (return a non-zero which indicates why it is not allowed).
+ *
+ * A /proc file can't have inode operations of its own any more, so this
+ * isn't called by the kernel for us - module_open calls it, with the way the
+ * file is being opened.  The permissions returned by ls -l are for referece
+ * only - this is the real check.
+ */
+static int module_permission(struct file *file)
+{
+   /* We allow everybody to read from our module, but only root (uid 0) may
+    * write to it
+    */
+   if (!(file->f_mode & FMODE_WRITE) || uid_eq(current_euid(), GLOBAL_ROOT_UID))
+      return 0;
+
+   /* If it's anything else, access is denied */
+   return -EACCES;
+}
 
 /* Called when the /proc file is opened */
 static int module_open(struct inode *inode, struct file *file)
 {
-   /* If the file's flags include O_NONBLOCK, it means the process doesn't want
-    * to wait for the file.  In this case, if the file is already open, we
-    * should fail with -EAGAIN, meaning "you'll have to try again", instead of
-    * blocking a process which would rather stay awake.
-    */
-   if ((file->f_flags & O_NONBLOCK) && Already_Open) 
-      return -EAGAIN;
+   int ret = module_permission(file);
 
-	 /* This is the correct place for MOD_INC_USE_COUNT because if a process is
-    * in the loop, which is within the kernel module, the kernel module must
-    * not be removed.
-    */
-   MOD_INC_USE_COUNT;
+   if (ret)
+      return ret;
 
-   /* If the file is already open, wait until it isn't */
-   while (Already_Open) 
+   /* If the file is already open, wait until it isn't.  Checking
+    * Already_Open and then setting it is two steps, and another process (on
+    * another CPU, or after a preemption) could get in between - so we do
+    * both at once, with atomic_cmpxchg, which sets it to 1 only if it was 0.
+    */
+   while (atomic_cmpxchg(&Already_Open, 0, 1) != 0)
    {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-      int i, is_sig = 0;
-#endif
+      /* If the file's flags include O_NONBLOCK, it means the process doesn't
+       * want to wait for the file.  In this case, we should fail with
+       * -EAGAIN, meaning "you'll have to try again", instead of blocking a
+       * process which would rather stay awake.
+       */
+      if (file->f_flags & O_NONBLOCK)
+         return -EAGAIN;
 
       /* This function puts the current process, including any system calls,
-       * such as us, to sleep.  Execution will be resumed right after the
-       * function call, either because somebody called wake_up(&WaitQ) (only
-       * module_close does that, when the file is closed) or when a signal,
-       * such as Ctrl-C, is sent to the process
+       * such as us, to sleep, until the condition is true - it's checked
+       * every time somebody calls wake_up(&WaitQ) (only module_close and
+       * cleanup_module do that).  It also returns when a signal, such as
+       * Ctrl-C, is sent to the process, in which case we fail the system
+       * call with -EINTR.  This allows processes to be killed or stopped.
+       *
+       * We used to sleep with module_interruptible_sleep_on, and then go
+       * through the signal words to see if we woke up because of a signal.
+       * If the file was closed between our check and going to sleep, we
+       * slept through the wake up.  wait_event_interruptible checks the
+       * condition after it's on the queue, so that can't happen, and it
+       * tells us about the signal itself.
+       *
+       * There's no more MOD_INC_USE_COUNT to undo here - /proc keeps the
+       * module around while we're in one of its functions.
        */
-      module_interruptible_sleep_on(&WaitQ);
- 
-      /* If we woke up because we got a signal we're not blocking, return
-       * -EINTR (fail the system call).  This allows processes to be killed or
-       * stopped.
-       */
-
-/*
- * Emmanuel Papirakis:
- *
- * This is a little update to work with 2.2.*.  Signals now are contained in
- * two words (64 bits) and are stored in a structure that contains an array of
- * two unsigned longs.  We now have to make 2 checks in our if.
- *
- * Ori Pomerantz:
- *
- * Nobody promised me they'll never use more than 64 bits, or that this book
- * won't be used for a version of Linux with a word size of 16 bits.  This code
- * would work in any case.
- */	  
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-      for (i = 0; i < _NSIG_WORDS && !is_sig; i++)
-         is_sig = current->signal.sig[i] & ~current->blocked.sig[i];
-
-      if (is_sig) {
-#else
-      if (current->signal & ~current->blocked) {
-#endif
-         /* It's important to put MOD_DEC_USE_COUNT here, because for processes
-          * where the open is interrupted there will never be a corresponding
-          * close. If we don't decrement the usage count here, we will be left
-          * with a positive usage count which we'll have no way to bring down
-          * to zero, giving us an immortal module, which can only be killed by
-          * rebooting the machine.
-          */
-         MOD_DEC_USE_COUNT;
+      if (wait_event_interruptible(WaitQ,
+                                   !atomic_read(&Already_Open) || Unloading))
          return -EINTR;
-      }
-   }
 
-   /* If we got here, Already_Open must be zero */
+      if (Unloading)
+         return -ENODEV;
+   }
 
-   /* Open the file */
-   Already_Open = 1;
+   /* If we got here, Already_Open was zero, and now it's ours */
    return 0;                                 /* Allow the access */
 }
 
 /* Called when the /proc file is closed */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-int module_close(struct inode *inode, struct file *file)
-#else
-void module_close(struct inode *inode, struct file *file)
-#endif
+static int module_close(struct inode *inode, struct file *file)
 {
    /* Set Already_Open to zero, so one of the processes in the WaitQ will be
     * able to set Already_Open back to one and to open the file.  All the other
-    * processes will be called when Already_Open is back to one, so they'll go
-    * back to sleep.
+    * processes will find Already_Open back at one, so they'll go back to
+    * sleep.
     */
-   Already_Open = 0;
+   atomic_set(&Already_Open, 0);
 
    /* Wake up all the processes in WaitQ, so if anybody is waiting for the
     * file, they can have it.
     */
-   module_wake_up(&WaitQ);
-
-   MOD_DEC_USE_COUNT;
+   wake_up(&WaitQ);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
    return 0;                                 /* success */
-#endif
-}
-
-/* This function decides whether to allow an operation (return zero) or not
- * allow it (return a non-zero which indicates why it is not allowed).
- *
- * The operation can be one of the following values:
- * 0 - Execute (run the "file" - meaningless in our case)
- * 2 - Write (input to the kernel module)
- * 4 - Read (output from the kernel module)
- *
- * This is the real function that checks file permissions. The permissions
- * returned by ls -l are for referece only, and can be overridden here. 
- */
-static int module_permission(struct inode *inode, int op)
-{
-   /* We allow everybody to read from our module, but only root (uid 0) may
-    * write to it
-    */ 
-   if (op == 4 || (op == 2 && current->euid == 0))
-      return 0; 
-
-   /* If it's anything else, access is denied */
-   return -EACCES;
 }
 
 /* Structures to register as the /proc file, with pointers to all the relevant
- * functions. 
+ * functions.
  */
 
-/* File operations for our proc file. This is where we place pointers to all
- * the functions called when somebody tries to do something to our file. NULL
- * means we don't want to deal with something.
- */
-static struct file_operations File_Ops_4_Our_Proc_File = {
-   NULL,                                   /* lseek */
-   module_output,                          /* "read" from the file */
-   module_input,                           /* "write" to the file */
-   NULL,                                   /* readdir */
-   NULL,                                   /* select */
-   NULL,                                   /* ioctl */
-   NULL,                                   /* mmap */
-   module_open,                    /* called when the /proc file is opened */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-   NULL,                                   /* flush */
-#endif
-   module_close};                          /* called when it's classed */
-
-/* Inode operations for our proc file.  We need it so we'll have somewhere to
- * specify the file operations structure we want to use, and the function we
- * use for permissions. It's also possible to specify functions to be called
- * for anything else which could be done to an inode (although we don't bother,
- * we just put NULL).
+/* Operations for our proc file. This is where we place pointers to all the
+ * functions called when somebody tries to do something to our file.  What
+ * isn't here is NULL, which means we don't want to deal with it.
  */
-static struct inode_operations Inode_Ops_4_Our_Proc_File = {
-   &File_Ops_4_Our_Proc_File,
-   NULL,                                   /* create */
-   NULL,                                   /* lookup */
-   NULL,                                   /* link */
-   NULL,                                   /* unlink */
-   NULL,                                   /* symlink */
-   NULL,                                   /* mkdir */
-   NULL,                                   /* rmdir */
-   NULL,                                   /* mknod */
-   NULL,                                   /* rename */
-   NULL,                                   /* readlink */
-   NULL,                                   /* follow_link */
-   NULL,                                   /* readpage */
-   NULL,                                   /* writepage */
-   NULL,                                   /* bmap */
-   NULL,                                   /* truncate */
-   module_permission};                     /* check for permissions */
-
-/* Directory entry */
-static struct proc_dir_entry Our_Proc_File = {
-	 0,                 /* Inode number - ignore, it will be filled by 
-                       * proc_register[_dynamic]
-                       */
-   5,                                      /* Length of the file name */
-   "sleep",                                /* The file name */
-
-   /* File mode - this is a regular file which can be read by its owner, its
-    * group, and everybody else. Also, its owner can write to it.
-    *
-    * Actually, this field is just for reference, it's module_permission that
-    * does the actual check. It could use this field, but in our
-    * implementation it doesn't, for simplicity.
-    */
-   S_IFREG | S_IRUGO | S_IWUSR, 
-   1,        /* Number of links (directories where the file is referenced) */
-   0, 0,     /* The uid and gid for the file - we give it to root */
-   80,       /* The size of the file reported by ls. */
-
-   /* A pointer to the inode structure for the file, if we need it. In our
-    * case we do, because we need a write function.
-    */
-   &Inode_Ops_4_Our_Proc_File, 
-
-   /* The read function for the file.  Irrelevant, because we put it in the
-    * inode structure above
-    */
-   NULL}; 
+static const struct proc_ops File_Ops_4_Our_Proc_File = {
+   .proc_open = module_open,       /* called when the /proc file is opened */
+   .proc_read = module_output,                /* "read" from the file */
+   .proc_write = module_input,                /* "write" to the file */
+   .proc_lseek = default_llseek,
+   .proc_release = module_close,   /* called when it's classed */
+};
 
 /* Module initialization and cleanup */
 
 /* Initialize the module - register the proc file */
-int init_module()
+int init_module(void)
 {
-   /* Success if proc_register_dynamic is a success, failure otherwise */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-   return proc_register(&proc_root, &Our_Proc_File);
-#else
-   return proc_register_dynamic(&proc_root, &Our_Proc_File);
-#endif 
-
-   /* proc_root is the root directory for the proc fs (/proc).  This is where
-    * we want our file to be located. 
+   /* File mode - this is a regular file which can be read by its owner, its
+    * group, and everybody else.  Also, its owner (root) can write to it.
+    * module_permission does the real check.
+    *
+    * NULL is the parent directory - the root of the proc fs (/proc).  This
+    * is where we want our file to be located.
     */
+   if (proc_create("sleep", S_IFREG | S_IRUGO | S_IWUSR, NULL,
+                   &File_Ops_4_Our_Proc_File) == NULL)
+      return -ENOMEM;
+
+   return 0;
 }
 
-/* Cleanup - unregister our file from /proc.  This could get dangerous if
- * there are still processes waiting in WaitQ, because they are inside our
- * open function, which will get unloaded. I'll explain how to avoid removal
- * of a kernel module in such a case in chapter 10.
+/* Cleanup - unregister our file from /proc.  This used to be dangerous if
+ * there were still processes waiting in WaitQ, because they are inside our
+ * open function, which will get unloaded.  Now we tell them to give up and
+ * wake them, and remove_proc_entry waits until they're out of module_open,
+ * and closes the file for whoever has it open.
  */
-void cleanup_module()
+void cleanup_module(void)
 {
-   proc_unregister(&proc_root, Our_Proc_File.low_ino);
-}  
+   Unloading = 1;
+   wake_up(&WaitQ);
 
+   remove_proc_entry("sleep", NULL);
+}
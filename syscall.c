@@ -1,6 +1,6 @@
-/*  syscall.c 
- * 
- *  System call "stealing" sample.
+/*  syscall.c
+ *
+ *  System call spying sample.
  */
 
 
@@ -12,170 +12,1824 @@
 /* Standard in kernel modules */
 #include <linux/kernel.h>   /* We're doing kernel work */
 #include <linux/module.h>   /* Specifically, a module */
+#include <linux/moduleparam.h>
 
-/* Deal with CONFIG_MODVERSIONS */
-#if CONFIG_MODVERSIONS==1
-#define MODVERSIONS
-#include <linux/modversions.h>
-#endif        
-
-#include <sys/syscall.h>  /* The list of system calls */
+/* We get into the system calls with kernel probes */
+#include <linux/kprobes.h>
+#include <linux/ptrace.h>
 
 /* For the current (process) structure, we need
  * this to know who the current user is. */
 #include <linux/sched.h>
+#include <linux/cred.h>
 
+#include <linux/uaccess.h>
 
+/* For the event buffers and the device they're read
+ * from */
+#include <linux/fs.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/hrtimer.h>
 
+/* For the filter set and the /proc file which controls
+ * it */
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/rcupdate.h>
+#include <linux/hash.h>
+#include <linux/string.h>
+#include <linux/cgroup.h>
 
-/* In 2.2.3 /usr/include/linux/version.h includes a 
- * macro for this, but 2.0.35 doesn't - so I add it 
- * here if necessary. */
-#ifndef KERNEL_VERSION
-#define KERNEL_VERSION(a,b,c) ((a)*65536+(b)*256+(c))
-#endif
+/* For the latency histograms */
+#include <linux/bitops.h>
+#include <linux/atomic.h>
+#include <linux/slab.h>
+
+/* For the aggregation table */
+#include <linux/spinlock.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/sort.h>
+#include <linux/overflow.h>
 
+/* What changed between the kernels we build for */
+#include "compat.h"
 
+/* The event format */
+#include "syscall.h"
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-#include <asm/uaccess.h>
+
+
+/* We need return probes, and a way to get at the
+ * arguments of the system call a probe is on -
+ * compat.h has that for the architectures the kernel
+ * supports kretprobes on. */
+#ifndef CONFIG_KRETPROBES
+#error "syscall.c needs a kernel with CONFIG_KRETPROBES"
 #endif
 
 
 
-/* The system call table (a table of functions). We 
- * just define this as external, and the kernel will 
- * fill it up for us when we are insmod'ed 
- */
-extern void *sys_call_table[];
+MODULE_LICENSE("GPL");
+
+
+
+/* UID we start out spying on - will be filled from
+ * the command line. Once we're running, the filter
+ * file in /proc decides who we spy on. */
+static int uid;
+
+module_param(uid, int, 0);
+
+
+
+
+/* The filter set ************************************ */
+
+
+/* We decide whether to record a system call with a
+ * filter set, which is written to /proc/sys_trace_filter
+ * as a whole, one entry per line:
+ *
+ *   syscall open
+ *   syscall read
+ *   uid 1000
+ *   uid 1001
+ *   gid 100
+ *   pid 4242
+ *   cgroup 2135
+ *   path /etc/
+ *
+ * The syscall lines say which system calls we trace
+ * (the names are in syscall.h). Without any, we trace
+ * only open, the way we always did.
+ *
+ * A call is recorded if it matches every kind of entry
+ * the set has - for the set above, it has to be by
+ * user 1000 or 1001, and by group 100, and by process
+ * 4242, in cgroup 2135, and if the call takes a file
+ * name, it has to start with /etc/. A set with no
+ * entries at all (not counting syscall lines) records
+ * nothing. The group is the process' effective group,
+ * supplementary groups don't count, and paths are
+ * compared as the process gave them to the call - a
+ * relative path never matches /etc/.
+ *
+ * A cgroup is given by its ID in the cgroup v2
+ * hierarchy, which is the inode number of its
+ * directory (stat -c %i /sys/fs/cgroup/system.slice),
+ * and takes in the cgroups below it too - so one line
+ * covers a service, or all of them.
+ *
+ * The IDs are kept in hash sets and the paths in a
+ * trie, so checking a call costs the same whether the
+ * set has one user or hundreds, and a call by a user
+ * who isn't in the set costs a hash and a comparison
+ * or two. */
+
+/* The hash sets use open addressing, and are never more
+ * than half full, so a lookup almost always finds what
+ * it looks for (or an empty slot) right away. */
+#define ID_SET_BITS 10
+#define ID_SET_SIZE (1 << ID_SET_BITS)
+#define ID_SET_MAX (ID_SET_SIZE / 2)
+#define ID_EMPTY ((u32) -1)
+
+struct id_set {
+  unsigned int count;
+  u32 slots[ID_SET_SIZE];
+};
+
+/* cgroup IDs are 64 bits, so they get a set of their
+ * own, the same but smaller. No cgroup has ID 0. */
+#define CGROUP_SET_BITS 8
+#define CGROUP_SET_SIZE (1 << CGROUP_SET_BITS)
+#define CGROUP_SET_MAX (CGROUP_SET_SIZE / 2)
+
+struct cgroup_set {
+  unsigned int count;
+  u64 slots[CGROUP_SET_SIZE];
+};
+
+/* Each node of the trie is a character of a prefix. The
+ * children of a node are a list, connected through
+ * sibling. Node 0 is the root, which isn't anybody's
+ * child or sibling, so 0 also means "none". */
+#define TRIE_MAX_NODES 8192
+
+struct trie_node {
+  char c;
+  unsigned char terminal;  /* A prefix ends here */
+  unsigned short child;
+  unsigned short sibling;
+};
+
+/* The longest filter we take, in bytes of text */
+#define FILTER_TEXT_MAX 65536
+
+struct filter_set {
+  unsigned long syscalls;  /* Bit n - TRACE_SYS n is on */
+  unsigned int entries;    /* In all of the below */
+  struct id_set uids;
+  struct id_set gids;
+  struct id_set pids;
+  struct cgroup_set cgroups;
+  unsigned int prefixes;
+  unsigned int nodes_used;
+  struct trie_node nodes[TRIE_MAX_NODES];
+  char *text;              /* As written, to read back */
+};
+
+
+/* The names of the system calls, for the filter and
+ * for /proc/sys_trace_top */
+static const char *Syscall_Names[TRACE_SYS_COUNT] = {
+  [TRACE_SYS_OPEN]   = "open",
+  [TRACE_SYS_READ]   = "read",
+  [TRACE_SYS_WRITE]  = "write",
+  [TRACE_SYS_CLOSE]  = "close",
+  [TRACE_SYS_STAT]   = "stat",
+  [TRACE_SYS_EXECVE] = "execve",
+};
+
+
+/* The filter set in use. The probe reads it under
+ * rcu_read_lock, without taking any lock, so a new set
+ * is put in place with rcu_assign_pointer, and the old
+ * one freed only after synchronize_rcu - when no probe
+ * can be looking at it any more. Filter_Lock keeps two
+ * writers from replacing it at the same time. */
+static struct filter_set *Filter;
+static DEFINE_MUTEX(Filter_Lock);
+
+
+
+/* Is id in the set? */
+static inline int id_set_has(const struct id_set *set,
+                             u32 id)
+{
+  unsigned int i;
+
+  for (i = hash_long(id, ID_SET_BITS);
+       set->slots[i] != ID_EMPTY;
+       i = (i + 1) & (ID_SET_SIZE - 1))
+    if (set->slots[i] == id)
+      return 1;
+
+  return 0;
+}
+
+
+/* Put id in the set */
+static int id_set_add(struct id_set *set, u32 id)
+{
+  unsigned int i;
+
+  if (id == ID_EMPTY)
+    return -EINVAL;
+
+  for (i = hash_long(id, ID_SET_BITS);
+       set->slots[i] != ID_EMPTY;
+       i = (i + 1) & (ID_SET_SIZE - 1))
+    if (set->slots[i] == id)
+      return 0;
+
+  if (set->count >= ID_SET_MAX)
+    return -ENOSPC;
+
+  set->slots[i] = id;
+  set->count++;
+
+  return 0;
+}
+
+
+/* Is cgroup id in the set? */
+static inline int cgroup_set_has(const struct cgroup_set *set,
+                                 u64 id)
+{
+  unsigned int i;
+
+  for (i = hash_64(id, CGROUP_SET_BITS);
+       set->slots[i] != 0;
+       i = (i + 1) & (CGROUP_SET_SIZE - 1))
+    if (set->slots[i] == id)
+      return 1;
+
+  return 0;
+}
+
+
+/* Put cgroup id in the set */
+static int cgroup_set_add(struct cgroup_set *set, u64 id)
+{
+  unsigned int i;
+
+  if (id == 0)
+    return -EINVAL;
+
+  for (i = hash_64(id, CGROUP_SET_BITS);
+       set->slots[i] != 0;
+       i = (i + 1) & (CGROUP_SET_SIZE - 1))
+    if (set->slots[i] == id)
+      return 0;
+
+  if (set->count >= CGROUP_SET_MAX)
+    return -ENOSPC;
+
+  set->slots[i] = id;
+  set->count++;
+
+  return 0;
+}
+
+
+/* Does path start with any of the prefixes in the
+ * trie? */
+static int trie_match(const struct filter_set *set,
+                      const char *path)
+{
+  unsigned int node = 0, i;
+
+  for (; *path; path++) {
+    for (i = set->nodes[node].child;
+         i && set->nodes[i].c != *path;
+         i = set->nodes[i].sibling)
+      ;
+    if (i == 0)
+      return 0;
+
+    node = i;
+    if (set->nodes[node].terminal)
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/* Put a prefix in the trie */
+static int trie_add(struct filter_set *set,
+                    const char *prefix)
+{
+  unsigned int node = 0, i;
+
+  if (*prefix == '\0')
+    return -EINVAL;
+
+  for (; *prefix; prefix++) {
+    for (i = set->nodes[node].child;
+         i && set->nodes[i].c != *prefix;
+         i = set->nodes[i].sibling)
+      ;
+
+    if (i == 0) {
+      if (set->nodes_used >= TRIE_MAX_NODES)
+        return -ENOSPC;
+
+      i = set->nodes_used++;
+      set->nodes[i].c = *prefix;
+      set->nodes[i].terminal = 0;
+      set->nodes[i].child = 0;
+      set->nodes[i].sibling = set->nodes[node].child;
+      set->nodes[node].child = i;
+    }
+
+    node = i;
+  }
+
+  set->nodes[node].terminal = 1;
+  set->prefixes++;
+
+  return 0;
+}
+
+
+/* Add one line of the filter's text to the set */
+static int parse_line(struct filter_set *set, char *line)
+{
+  char *kind, *arg, *end;
+  u64 cgroup;
+  int ret, sys;
+  u32 id;
+
+  /* Split the line into a kind and an argument, and
+   * trim the spaces around them */
+  while (*line == ' ' || *line == '\t')
+    line++;
+  if (*line == '\0' || *line == '#')
+    return 0;
+
+  arg = line;
+  kind = strsep(&arg, " \t");
+  if (arg == NULL)
+    return -EINVAL;
+  while (*arg == ' ' || *arg == '\t')
+    arg++;
+  end = arg + strlen(arg);
+  while (end > arg && (end[-1] == ' ' || end[-1] == '\t' ||
+                       end[-1] == '\r'))
+    *--end = '\0';
+
+  /* syscall lines don't count as entries - they say
+   * what we look at, not whose */
+  if (strcmp(kind, "syscall") == 0) {
+    for (sys = 0; sys < TRACE_SYS_COUNT; sys++)
+      if (strcmp(arg, Syscall_Names[sys]) == 0) {
+        set->syscalls |= 1UL << sys;
+        return 0;
+      }
+    return -EINVAL;
+  }
+
+  if (strcmp(kind, "path") == 0)
+    ret = trie_add(set, arg);
+  else if (strcmp(kind, "cgroup") == 0) {
+    if (!IS_ENABLED(CONFIG_CGROUPS) ||
+        kstrtou64(arg, 10, &cgroup))
+      return -EINVAL;
+    ret = cgroup_set_add(&set->cgroups, cgroup);
+  } else {
+    /* An ID which doesn't fit in 32 bits is a
+     * mistake, not another ID */
+    if (kstrtou32(arg, 10, &id))
+      return -EINVAL;
+
+    if (strcmp(kind, "uid") == 0)
+      ret = id_set_add(&set->uids, id);
+    else if (strcmp(kind, "gid") == 0)
+      ret = id_set_add(&set->gids, id);
+    else if (strcmp(kind, "pid") == 0)
+      ret = id_set_add(&set->pids, id);
+    else
+      return -EINVAL;
+  }
+
+  if (ret == 0)
+    set->entries++;
+
+  return ret;
+}
+
+
+static void free_filter(struct filter_set *set)
+{
+  if (set == NULL)
+    return;
+
+  vfree(set->text);
+  vfree(set);
+}
+
+
+/* Make a filter set out of its text, which is length
+ * bytes long (without a terminating NULL). */
+static struct filter_set *make_filter(const char *text,
+                                      size_t length,
+                                      int *error)
+{
+  struct filter_set *set;
+  char *work, *rest, *line;
+  int ret = 0;
+
+  set = vmalloc(sizeof(struct filter_set));
+  work = vmalloc(length + 1);
+  if (set == NULL || work == NULL) {
+    vfree(set);
+    vfree(work);
+    *error = -ENOMEM;
+    return NULL;
+  }
+
+  memset(set, 0, sizeof(struct filter_set));
+  memset(set->uids.slots, 0xff, sizeof(set->uids.slots));
+  memset(set->gids.slots, 0xff, sizeof(set->gids.slots));
+  memset(set->pids.slots, 0xff, sizeof(set->pids.slots));
+  set->nodes_used = 1;   /* The root */
+
+  /* strsep cuts up the text it works on, but we want
+   * to keep the text to show when the file is read. So
+   * we parse a copy, and once we're done, copy the
+   * original over it again and keep that. */
+  memcpy(work, text, length);
+  work[length] = '\0';
+  rest = work;
+  while (ret == 0 && (line = strsep(&rest, "\n")) != NULL)
+    ret = parse_line(set, line);
+
+  if (ret < 0) {
+    vfree(work);
+    vfree(set);
+    *error = ret;
+    return NULL;
+  }
+
+  if (set->syscalls == 0)
+    set->syscalls = 1UL << TRACE_SYS_OPEN;
+
+  memcpy(work, text, length);
+  set->text = work;
+
+  return set;
+}
+
 
+static void sync_hooks(unsigned long syscalls);
 
-/* UID we want to spy on - will be filled from the 
- * command line */
-int uid;  
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-MODULE_PARM(uid, "i");
+/* Put a new filter set in place of the old one, place
+ * or remove the probes for the system calls it turns
+ * on or off, and free the old set once no probe can be
+ * using it. */
+static void replace_filter(struct filter_set *set)
+{
+  struct filter_set *old;
+
+  mutex_lock(&Filter_Lock);
+  old = Filter;
+  rcu_assign_pointer(Filter, set);
+  sync_hooks(set->syscalls);
+  mutex_unlock(&Filter_Lock);
+
+  synchronize_rcu();
+  free_filter(old);
+}
+
+
+/* Is the current process in one of the set's cgroups,
+ * or below one? Called under rcu_read_lock, which
+ * keeps its cgroups from going away while we look. */
+static inline int filter_cgroups(const struct filter_set *set)
+{
+#ifdef CONFIG_CGROUPS
+  struct cgroup *cgrp;
+
+  for (cgrp = task_dfl_cgroup(current); cgrp;
+       cgrp = cgroup_parent(cgrp))
+    if (cgroup_set_has(&set->cgroups, cgroup_id(cgrp)))
+      return 1;
 #endif
 
-/* A pointer to the original system call. The reason 
- * we keep this, rather than call the original function 
- * (sys_open), is because somebody else might have 
- * replaced the system call before us. Note that this 
- * is not 100% safe, because if another module 
- * replaced sys_open before us, then when we're inserted 
- * we'll call the function in that module - and it 
- * might be removed before we are.
+  return 0;
+}
+
+
+/* Does the current process match the IDs in the set?
+ * Called for every call of a system call we trace, so
+ * this is where being fast matters. */
+static inline int filter_ids(const struct filter_set *set)
+{
+  if (set->entries == 0)
+    return 0;
+
+  if (set->uids.count &&
+      !id_set_has(&set->uids, CURRENT_UID()))
+    return 0;
+
+  if (set->gids.count &&
+      !id_set_has(&set->gids, CURRENT_GID()))
+    return 0;
+
+  if (set->pids.count &&
+      !id_set_has(&set->pids, current->tgid))
+    return 0;
+
+  if (set->cgroups.count && !filter_cgroups(set))
+    return 0;
+
+  return 1;
+}
+
+
+
+/* The filter's /proc file. Reading it gives the set in
+ * use, writing it replaces the set - each write has to
+ * hold the whole new set. */
+static int filter_show(struct seq_file *m, void *v)
+{
+  mutex_lock(&Filter_Lock);
+  seq_puts(m, Filter->text);
+  mutex_unlock(&Filter_Lock);
+
+  return 0;
+}
+
+
+static int filter_open(struct inode *inode,
+                       struct file *file)
+{
+  return single_open(file, filter_show, NULL);
+}
+
+
+static ssize_t filter_write(struct file *file,
+                            const char __user *buffer,
+                            size_t length,
+                            loff_t *offset)
+{
+  struct filter_set *set;
+  char *text;
+  int ret;
+
+  if (length > FILTER_TEXT_MAX)
+    return -EINVAL;
+
+  text = vmalloc(length + 1);
+  if (text == NULL)
+    return -ENOMEM;
+
+  if (copy_from_user(text, buffer, length)) {
+    vfree(text);
+    return -EFAULT;
+  }
+
+  set = make_filter(text, length, &ret);
+  vfree(text);
+  if (set == NULL)
+    return ret;
+
+  replace_filter(set);
+
+  return length;
+}
+
+
+static const struct proc_ops Filter_Fops = {
+  .proc_open = filter_open,
+  .proc_read = seq_read,
+  .proc_write = filter_write,
+  .proc_lseek = seq_lseek,
+  .proc_release = single_release,
+};
+
+
+
+/* The event buffers ********************************* */
+
+
+/* Printing each call we see goes through the kernel's
+ * log buffer, which has one lock for the whole machine,
+ * so a busy user makes it the bottleneck. Instead, each
+ * call is written as a struct trace_event into a buffer
+ * for the CPU it returned on, and a process reads them
+ * from our device in batches.
+ *
+ * A CPU's buffer is a ring with exactly one writer, the
+ * probe on that CPU (which can't be preempted or
+ * migrated while it runs), and one reader, so it needs
+ * no lock:
+ *
+ * head - advanced by the probe, for each new event
+ * tail - advanced by the reader, for each event read
  *
- * Another reason for this is that we can't get sys_open.
- * It's a static variable, so it is not exported. */
-asmlinkage int (*original_call)(const char *, int, int);
+ * The indices never wrap around, only the slots they
+ * map to do. tail is on a cache line of its own, so
+ * the reader doesn't steal head's line from the CPU on
+ * every event. */
+#define RING_EVENTS 256  /* Must be a power of two */
+#define RING_SLOT(i) ((i) & (RING_EVENTS - 1))
+
+struct trace_ring {
+  unsigned int head;
+  unsigned long drops;  /* Events lost, ring was full */
+  unsigned int tail ____cacheline_aligned;
+  struct trace_event events[RING_EVENTS];
+};
+
+/* A ring is too big for the per-CPU area, so each CPU
+ * has a pointer there, to a ring of its own */
+static DEFINE_PER_CPU(struct trace_ring *, Rings);
+
+
+/* Readers sleep here until there are events */
+static DECLARE_WAIT_QUEUE_HEAD(Trace_WaitQ);
 
+/* Only one process at a time may read events */
+static DEFINE_MUTEX(Reader_Lock);
 
 
-/* For some reason, in 2.2.3 current->uid gave me 
- * zero, not the real user ID. I tried to find what went 
- * wrong, but I couldn't do it in a short time, and 
- * I'm lazy - so I'll just use the system call to get the 
- * uid, the way a process would. 
+/* The dynamic major number of our device */
+static int Major;
+
+
+
+/* Copy the file name a call got into path, which has room
+ * for TRACE_PATH_LEN bytes, and say in path_flags if it
+ * had to be cut or couldn't be copied at all. Returns
+ * the length of what was copied.
  *
- * For some reason, after I recompiled the kernel this 
- * problem went away. 
- */
-asmlinkage int (*getuid_call)();
+ * The probe handler runs with preemption disabled, so
+ * we mustn't sleep. Normally copying from user space
+ * can sleep, to bring in a page which was swapped out.
+ * The _nofault copy fails instead - which almost never
+ * happens, because the process has just used the file
+ * name. */
+static unsigned int copy_path(char *path,
+                              const char __user *filename,
+                              __u16 *path_flags)
+{
+  long len;
+
+  *path_flags = 0;
+
+  len = strncpy_from_user_nofault(path, filename,
+                                  TRACE_PATH_LEN - 1);
 
+  if (len < 0) {
+    len = 0;
+    *path_flags = TRACE_PATH_FAULT;
+  } else if (len == TRACE_PATH_LEN - 1)
+    *path_flags = TRACE_PATH_CUT;
 
+  path[len] = '\0';
 
-/* The function we'll replace sys_open (the function 
- * called when you call the open system call) with. To 
- * find the exact prototype, with the number and type 
- * of arguments, we find the original function first 
- * (it's at fs/open.c). 
+  return len;
+}
+
+
+/* What the entry of a call leaves for its return. The
+ * kernel keeps one of these for every call in progress
+ * of a function we probe. */
+struct hook_call {
+  u64 time;
+  int record;     /* Put it in a ring when it returns? */
+  u64 args[2];
+  unsigned int path_len;
+  __u16 path_flags;
+  char path[TRACE_PATH_LEN];
+};
+
+
+/* Record a call of system call sys, which returned ret
+ * after latency nanoseconds, in the current CPU's ring.
+ * Called from the probe, so we can't sleep. */
+static void record_event(int sys, const struct hook_call *call,
+                         long ret, u64 latency)
+{
+  struct trace_ring *ring = this_cpu_read(Rings);
+  struct trace_event *event;
+
+  /* If the reader didn't keep up, we lose the new event
+   * - we can't wait for it here */
+  if (ring->head - ring->tail >= RING_EVENTS) {
+    ring->drops++;
+    return;
+  }
+
+  event = &ring->events[RING_SLOT(ring->head)];
+  event->time = call->time;
+  event->latency = latency;
+  event->ret = ret;
+  event->args[0] = call->args[0];
+  event->args[1] = call->args[1];
+  event->pid = current->tgid;
+  event->uid = CURRENT_UID();
+  event->syscall = sys;
+  event->path_len = call->path_len;
+  event->path_flags = call->path_flags;
+  memcpy(event->path, call->path, call->path_len + 1);
+
+  /* The event has to be in memory before the reader
+   * can see the new head */
+  smp_wmb();
+  ring->head++;
+
+  /* Only bother with the wait queue's lock if somebody
+   * is waiting. The barrier makes sure that a reader
+   * who went to sleep just now either sees the new
+   * head, or is seen by waitqueue_active. */
+  smp_mb();
+  if (waitqueue_active(&Trace_WaitQ))
+    wake_up_interruptible(&Trace_WaitQ);
+}
+
+
+
+/* Aggregation ****************************************** */
+
+
+/* Often we don't need every call, only which files
+ * each user opens (or stats, or executes) most. If
+ * aggregate is set (insmod syscall.ko aggregate=1),
+ * calls aren't put in the rings at all. Instead we
+ * count them, per system call, user and path, in a
+ * table of aggregate_slots entries, and
+ * /proc/sys_trace_top shows the table, most called
+ * first. Calls without a path - read, write and
+ * close - are counted per user, under an empty path.
  *
- * In theory, this means that we're tied to the 
- * current version of the kernel. In practice, the 
- * system calls almost never change (it would wreck havoc 
- * and require programs to be recompiled, since the system
- * calls are the interface between the kernel and the 
- * processes).
- */
-asmlinkage int our_sys_open(const char *filename, 
-                            int flags, 
-                            int mode)
-{
-  int i = 0;
-  char ch;
-
-  /* Check if this is the user we're spying on */
-  if (uid == getuid_call()) {  
-   /* getuid_call is the getuid system call, 
-    * which gives the uid of the user who
-    * ran the process which called the system
-    * call we got */
-
-    /* Report the file, if relevant */
-    printk("Opened file by %d: ", uid); 
-    do {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,2,0)
-      get_user(ch, filename+i);
-#else
-      ch = get_user(filename+i);
-#endif
-      i++;
-      printk("%c", ch);
-    } while (ch != 0);
-    printk("\n");
+ * The table can't grow without bounds, so once it's
+ * full, a key we don't have yet replaces the entry
+ * with the lowest count, and takes over that count
+ * plus one. This is the "space saving" algorithm -
+ * every key which was seen more often than the total
+ * number of calls divided by the number of entries is
+ * guaranteed to be in the table, and no count is too
+ * high by more than the error column, which is the
+ * count the entry took over. To find the
+ * entry with the lowest count quickly, the entries are
+ * also kept in a heap ordered by count. */
+static int aggregate = 0;
+static int aggregate_slots = 1024;
+
+module_param(aggregate, int, 0);
+module_param(aggregate_slots, int, 0);
+
+struct agg_entry {
+  u64 count;
+  u64 error;      /* count is at most this much too high */
+  u64 last_seen;  /* Nanoseconds, monotonic clock */
+  u32 uid;
+  u32 syscall;    /* TRACE_SYS_... */
+  u32 hash;       /* Of syscall, uid and path */
+  int next;       /* In the hash chain, -1 for none */
+  int heap_pos;   /* Where the entry is in Agg_Heap */
+  char path[TRACE_PATH_LEN];
+};
+
+static struct agg_entry *Agg_Entries;
+static int *Agg_Buckets;  /* Hash chain heads, -1 for none */
+static int *Agg_Heap;     /* Entry numbers, lowest count first */
+static unsigned int Agg_Bucket_Mask;
+static int Agg_Used;
+static unsigned long Agg_Evictions;
+
+/* The probe can run on all CPUs at once, and they all
+ * count into the same table */
+static DEFINE_SPINLOCK(Agg_Lock);
+
+
+
+/* Swap two places in the heap */
+static void heap_swap(int a, int b)
+{
+  int entry = Agg_Heap[a];
+
+  Agg_Heap[a] = Agg_Heap[b];
+  Agg_Heap[b] = entry;
+  Agg_Entries[Agg_Heap[a]].heap_pos = a;
+  Agg_Entries[Agg_Heap[b]].heap_pos = b;
+}
+
+
+#define HEAP_COUNT(pos) (Agg_Entries[Agg_Heap[pos]].count)
+
+
+/* An entry's count went up - move it down the heap, to
+ * where it belongs */
+static void heap_down(int pos)
+{
+  int child;
+
+  for (;;) {
+    child = 2 * pos + 1;
+    if (child >= Agg_Used)
+      break;
+    if (child + 1 < Agg_Used &&
+        HEAP_COUNT(child + 1) < HEAP_COUNT(child))
+      child++;
+    if (HEAP_COUNT(pos) <= HEAP_COUNT(child))
+      break;
+
+    heap_swap(pos, child);
+    pos = child;
   }
+}
+
+
+/* A new entry at the end of the heap - move it up to
+ * where it belongs */
+static void heap_up(int pos)
+{
+  int parent;
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (HEAP_COUNT(parent) <= HEAP_COUNT(pos))
+      break;
+
+    heap_swap(pos, parent);
+    pos = parent;
+  }
+}
+
+
+/* Take an entry out of its hash chain */
+static void agg_unlink(int entry)
+{
+  int *link = &Agg_Buckets[Agg_Entries[entry].hash &
+                           Agg_Bucket_Mask];
 
-  /* Call the original sys_open - otherwise, we lose 
-   * the ability to open files */
-  return original_call(filename, flags, mode);
+  while (*link != entry)
+    link = &Agg_Entries[*link].next;
+  *link = Agg_Entries[entry].next;
 }
 
 
+/* Count a call of system call sys by uid, with path,
+ * which is len bytes long */
+static void agg_count(u32 sys, u32 uid, const char *path,
+                      unsigned int len)
+{
+  struct agg_entry *entry;
+  u64 now = ktime_get_ns();
+  u32 hash = jhash(path, len, jhash_2words(sys, uid, 0));
+  int i;
+
+  spin_lock(&Agg_Lock);
+
+  for (i = Agg_Buckets[hash & Agg_Bucket_Mask];
+       i >= 0;
+       i = Agg_Entries[i].next) {
+    entry = &Agg_Entries[i];
+    if (entry->hash == hash && entry->uid == uid &&
+        entry->syscall == sys &&
+        strcmp(entry->path, path) == 0) {
+      entry->count++;
+      entry->last_seen = now;
+      heap_down(entry->heap_pos);
+      spin_unlock(&Agg_Lock);
+      return;
+    }
+  }
+
+  if (Agg_Used < aggregate_slots) {
+    /* There's still room - a new entry, with a count of
+     * one, which belongs near the top of the heap */
+    i = Agg_Used++;
+    entry = &Agg_Entries[i];
+    entry->count = 1;
+    entry->error = 0;
+    entry->heap_pos = i;
+    Agg_Heap[i] = i;
+    heap_up(i);
+  } else {
+    /* The table is full - the entry with the lowest
+     * count makes room */
+    i = Agg_Heap[0];
+    entry = &Agg_Entries[i];
+    agg_unlink(i);
+    entry->error = entry->count;
+    entry->count++;
+    heap_down(0);
+    Agg_Evictions++;
+  }
+
+  entry->uid = uid;
+  entry->syscall = sys;
+  entry->hash = hash;
+  entry->last_seen = now;
+  memcpy(entry->path, path, len + 1);
+  entry->next = Agg_Buckets[hash & Agg_Bucket_Mask];
+  Agg_Buckets[hash & Agg_Bucket_Mask] = i;
 
-/* Initialize the module - replace the system call */
-int init_module()
+  spin_unlock(&Agg_Lock);
+}
+
+
+static int agg_alloc(void)
 {
-  /* Warning - too late for it now, but maybe for 
-   * next time... */
-  printk("I'm dangerous. I hope you did a ");
-  printk("sync before you insmod'ed me.\n");
-  printk("My counterpart, cleanup_module(), is even"); 
-  printk("more dangerous. If\n");
-  printk("you value your file system, it will ");
-  printk("be \"sync; rmmod\" \n");
-  printk("when you remove this module.\n");
+  int i, buckets;
 
-  /* Keep a pointer to the original function in 
-   * original_call, and then replace the system call 
-   * in the system call table with our_sys_open */
-  original_call = sys_call_table[__NR_open];
-  sys_call_table[__NR_open] = our_sys_open;
+  if (aggregate_slots < 1)
+    return -EINVAL;
 
-  /* To get the address of the function for system 
-   * call foo, go to sys_call_table[__NR_foo]. */
+  /* At least as many chains as entries */
+  buckets = roundup_pow_of_two(aggregate_slots);
+  Agg_Bucket_Mask = buckets - 1;
 
-  printk("Spying on UID:%d\n", uid);
+  Agg_Entries = vmalloc(aggregate_slots *
+                        sizeof(struct agg_entry));
+  Agg_Heap = vmalloc(aggregate_slots * sizeof(int));
+  Agg_Buckets = vmalloc(buckets * sizeof(int));
+  if (Agg_Entries == NULL || Agg_Heap == NULL ||
+      Agg_Buckets == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < buckets; i++)
+    Agg_Buckets[i] = -1;
+
+  return 0;
+}
+
+
+static void agg_free(void)
+{
+  vfree(Agg_Entries);
+  vfree(Agg_Heap);
+  vfree(Agg_Buckets);
+}
+
+
+
+/* /proc/sys_trace_top. When it's opened, we take a
+ * snapshot of the table, sorted by count, so the
+ * counting can go on while the process reads it at its
+ * own pace.
+ *
+ * Every probe takes Agg_Lock, so we copy the table
+ * under it TOP_COPY_BATCH entries at a time, never
+ * holding it for longer than a probe would. Each entry
+ * is copied whole, but the table can change between
+ * batches - an entry which is evicted meanwhile may
+ * be missing, or there with its replacement's count.
+ * For a list of the busiest entries, that's close
+ * enough. */
+#define TOP_COPY_BATCH 16
+
+struct agg_snapshot {
+  int entries;
+  unsigned long evictions;
+  struct agg_entry entry[];
+};
+
+
+static int agg_compare(const void *a, const void *b)
+{
+  const struct agg_entry *x = a, *y = b;
+
+  if (x->count != y->count)
+    return x->count < y->count ? 1 : -1;
+  return 0;
+}
+
+
+static void *top_start(struct seq_file *m, loff_t *pos)
+{
+  struct agg_snapshot *snap = m->private;
+
+  /* Position 0 is the header, the entries come after */
+  return *pos <= snap->entries ? pos : NULL;
+}
+
+
+static void *top_next(struct seq_file *m, void *v,
+                      loff_t *pos)
+{
+  (*pos)++;
+  return top_start(m, pos);
+}
+
+
+static void top_stop(struct seq_file *m, void *v)
+{
+}
+
+
+static int top_show(struct seq_file *m, void *v)
+{
+  struct agg_snapshot *snap = m->private;
+  struct agg_entry *entry;
+  loff_t pos = *(loff_t *) v;
+
+  if (pos == 0) {
+    seq_printf(m, "# %lu evictions\n", snap->evictions);
+    seq_puts(m, "# count error syscall uid last_seen path\n");
+    return 0;
+  }
 
-  /* Get the system call for getuid */
-  getuid_call = sys_call_table[__NR_getuid];
+  entry = &snap->entry[pos - 1];
+  seq_printf(m, "%llu %llu %s %u %llu %s\n",
+             (unsigned long long) entry->count,
+             (unsigned long long) entry->error,
+             Syscall_Names[entry->syscall],
+             entry->uid,
+             (unsigned long long) entry->last_seen,
+             entry->path);
 
   return 0;
 }
 
 
-/* Cleanup - unregister the appropriate file from /proc */
-void cleanup_module()
+static const struct seq_operations Top_Ops = {
+  .start = top_start,
+  .next = top_next,
+  .stop = top_stop,
+  .show = top_show,
+};
+
+
+static int top_open(struct inode *inode, struct file *file)
 {
-  /* Return the system call back to normal */
-  if (sys_call_table[__NR_open] != our_sys_open) {
-    printk("Somebody else also played with the ");
-    printk("open system call\n");
-    printk("The system may be left in ");
-    printk("an unstable state.\n");
+  struct agg_snapshot *snap;
+  int ret, n;
+
+  snap = vmalloc(struct_size(snap, entry, aggregate_slots));
+  if (snap == NULL)
+    return -ENOMEM;
+
+  snap->entries = 0;
+  do {
+    spin_lock(&Agg_Lock);
+    n = min(Agg_Used - snap->entries, TOP_COPY_BATCH);
+    memcpy(&snap->entry[snap->entries],
+           &Agg_Entries[snap->entries],
+           array_size(n, sizeof(struct agg_entry)));
+    snap->evictions = Agg_Evictions;
+    spin_unlock(&Agg_Lock);
+
+    snap->entries += n;
+  } while (n == TOP_COPY_BATCH);
+
+  sort(snap->entry, snap->entries, sizeof(struct agg_entry),
+       agg_compare, NULL);
+
+  ret = seq_open(file, &Top_Ops);
+  if (ret < 0) {
+    vfree(snap);
+    return ret;
   }
 
-  sys_call_table[__NR_open] = original_call;
-}  
+  ((struct seq_file *) file->private_data)->private = snap;
+
+  return 0;
+}
+
+
+static int top_release(struct inode *inode,
+                       struct file *file)
+{
+  vfree(((struct seq_file *) file->private_data)->private);
+
+  return seq_release(inode, file);
+}
+
+
+static const struct proc_ops Top_Fops = {
+  .proc_open = top_open,
+  .proc_read = seq_read,
+  .proc_lseek = seq_lseek,
+  .proc_release = top_release,
+};
+
+
+
+/* Latency histograms ********************************** */
+
+
+/* A slow open on a network or overlay file system is
+ * easy to miss in a stream of events, and aggregation
+ * doesn't time the calls at all. So, unless histograms
+ * is 0, we also count every call the filter set lets
+ * through in a histogram of how long it took, one for
+ * each system call and user, and /proc/sys_trace_latency
+ * shows them. Writing anything to that file starts them
+ * all over.
+ *
+ * Bucket n counts the calls which took from 2^n to
+ * 2^(n+1) - 1 nanoseconds (bucket 0 also has those
+ * which took no time at all), and the last bucket
+ * everything longer - a bit over two seconds.
+ *
+ * Like the rings, each CPU has a table of its own which
+ * only its probes write to, so counting a call takes
+ * no lock and no atomic instruction. The table is a
+ * hash of (system call, user) keys with open
+ * addressing. Once it's three quarters full, calls of
+ * new keys are only counted in overflow. */
+static int histograms = 1;
+
+module_param(histograms, int, 0);
+
+#define LAT_BUCKETS 32
+#define LAT_SLOT_BITS 8
+#define LAT_SLOTS (1 << LAT_SLOT_BITS)
+#define LAT_MAX_USED (LAT_SLOTS * 3 / 4)
+
+struct lat_hist {
+  u32 uid;
+  u16 syscall;
+  u16 used;       /* Is the slot taken? */
+  u64 calls;
+  u64 buckets[LAT_BUCKETS];
+};
+
+struct lat_table {
+  unsigned int generation;  /* See below */
+  unsigned int used;        /* Slots taken */
+  u64 overflow;             /* Calls we had no slot for */
+  struct lat_hist slots[LAT_SLOTS];
+};
 
+/* Like the rings, too big for the per-CPU area - each
+ * CPU has a pointer to its table there */
+static DEFINE_PER_CPU(struct lat_table *, Lat_Tables);
+
+
+/* A CPU's table can only be cleared by its own probes,
+ * or a reset would race with them. So a reset just
+ * bumps Lat_Generation. A probe which finds its table
+ * from an older generation clears it before counting,
+ * and the reader ignores tables which haven't caught
+ * up yet - they have nothing since the reset. */
+static atomic_t Lat_Generation = ATOMIC_INIT(0);
+
+
+
+static inline u32 lat_hash(int sys, u32 uid)
+{
+  return hash_32(uid ^ ((u32) sys << 24), LAT_SLOT_BITS);
+}
+
+
+/* Find the slot of (sys, uid) in table, or NULL if it
+ * isn't there */
+static struct lat_hist *lat_find(struct lat_table *table,
+                                 int sys, u32 uid)
+{
+  struct lat_hist *slot;
+  u32 i = lat_hash(sys, uid);
+
+  for (;; i = (i + 1) & (LAT_SLOTS - 1)) {
+    slot = &table->slots[i];
+    if (!slot->used)
+      return NULL;
+    if (slot->uid == uid && slot->syscall == sys)
+      return slot;
+  }
+}
+
+
+/* Count a call of sys by uid which took latency
+ * nanoseconds. Called from the probe, with preemption
+ * disabled, so we stay on this CPU's table. */
+static void lat_count(int sys, u32 uid, u64 latency)
+{
+  struct lat_table *table = this_cpu_read(Lat_Tables);
+  unsigned int generation = atomic_read(&Lat_Generation);
+  struct lat_hist *slot;
+  int bucket;
+  u32 i;
+
+  if (table->generation != generation) {
+    memset(table->slots, 0, sizeof(table->slots));
+    table->used = 0;
+    table->overflow = 0;
+    /* The slots have to be clear before the reader
+     * looks at them */
+    smp_wmb();
+    table->generation = generation;
+  }
+
+  bucket = latency ? fls64(latency) - 1 : 0;
+  if (bucket >= LAT_BUCKETS)
+    bucket = LAT_BUCKETS - 1;
+
+  for (i = lat_hash(sys, uid);; i = (i + 1) & (LAT_SLOTS - 1)) {
+    slot = &table->slots[i];
+    if (slot->used) {
+      if (slot->uid == uid && slot->syscall == sys)
+        break;
+      continue;
+    }
+
+    if (table->used >= LAT_MAX_USED) {
+      table->overflow++;
+      return;
+    }
+
+    slot->uid = uid;
+    slot->syscall = sys;
+    /* The key has to be there before the reader can see
+     * the slot is taken */
+    smp_wmb();
+    slot->used = 1;
+    table->used++;
+    break;
+  }
+
+  slot->calls++;
+  slot->buckets[bucket]++;
+}
+
+
+/* Is a CPU's table up to date? If not, it has nothing
+ * since the last reset. */
+static inline int lat_current(const struct lat_table *table,
+                              unsigned int generation)
+{
+  int current_gen = table->generation == generation;
+
+  smp_rmb();
+  return current_gen;
+}
+
+
+/* /proc/sys_trace_latency. Each (system call, user) key
+ * may be in the tables of several CPUs, so we print it
+ * when we find it in the first one, with the counts of
+ * all the others added, and skip it in the rest. The
+ * counts can move on while we add them up - each one
+ * is exact, but the line as a whole may not be. */
+static int latency_show(struct seq_file *m, void *v)
+{
+  unsigned int generation = atomic_read(&Lat_Generation);
+  struct lat_table *table, *other_table;
+  struct lat_hist *slot, *other;
+  u64 calls, overflow = 0;
+  u64 *buckets;
+  int cpu, later, i, b;
+
+  buckets = kmalloc(LAT_BUCKETS * sizeof(u64), GFP_KERNEL);
+  if (buckets == NULL)
+    return -ENOMEM;
+
+  seq_puts(m, "# syscall uid calls, then calls per log2 "
+           "nanoseconds bucket\n");
+
+  for_each_possible_cpu(cpu) {
+    table = per_cpu(Lat_Tables, cpu);
+    if (!lat_current(table, generation))
+      continue;
+    overflow += table->overflow;
+
+    for (i = 0; i < LAT_SLOTS; i++) {
+      slot = &table->slots[i];
+      if (!slot->used)
+        continue;
+      smp_rmb();
+
+      /* Already printed with an earlier CPU's table? */
+      for_each_possible_cpu(later) {
+        if (later == cpu)
+          break;
+        other_table = per_cpu(Lat_Tables, later);
+        if (lat_current(other_table, generation) &&
+            lat_find(other_table, slot->syscall, slot->uid))
+          break;
+      }
+      if (later != cpu)
+        continue;
+
+      calls = slot->calls;
+      memcpy(buckets, slot->buckets, LAT_BUCKETS * sizeof(u64));
+      for_each_possible_cpu(later) {
+        other_table = per_cpu(Lat_Tables, later);
+        if (later <= cpu ||
+            !lat_current(other_table, generation))
+          continue;
+        other = lat_find(other_table, slot->syscall, slot->uid);
+        if (other == NULL)
+          continue;
+        calls += other->calls;
+        for (b = 0; b < LAT_BUCKETS; b++)
+          buckets[b] += other->buckets[b];
+      }
+
+      seq_printf(m, "%s %u %llu", Syscall_Names[slot->syscall],
+                 slot->uid, (unsigned long long) calls);
+      for (b = 0; b < LAT_BUCKETS; b++)
+        seq_printf(m, " %llu", (unsigned long long) buckets[b]);
+      seq_putc(m, '\n');
+    }
+  }
+
+  seq_printf(m, "# %llu calls of users we had no room for\n",
+             (unsigned long long) overflow);
+
+  kfree(buckets);
+  return 0;
+}
+
+
+static int latency_open(struct inode *inode,
+                        struct file *file)
+{
+  return single_open(file, latency_show, NULL);
+}
+
+
+/* Anything written to the file resets the histograms */
+static ssize_t latency_write(struct file *file,
+                             const char __user *buffer,
+                             size_t count, loff_t *offset)
+{
+  atomic_inc(&Lat_Generation);
+  return count;
+}
+
+
+static const struct proc_ops Latency_Fops = {
+  .proc_open = latency_open,
+  .proc_read = seq_read,
+  .proc_write = latency_write,
+  .proc_lseek = seq_lseek,
+  .proc_release = single_release,
+};
+
+
+
+/* The probes ****************************************** */
+
+
+/* We used to replace sys_open in the system call table
+ * with a function of our own, and call the original
+ * from it. That's dangerous - if another module did
+ * the same thing after us, removing us would remove it
+ * as well - and it costs every open on the system an
+ * extra function call, even for the users we don't
+ * care about.
+ *
+ * Instead, we put kernel probes on the functions the
+ * system call table points to (SYSCALL_SYMBOL has
+ * their names, which depend on the architecture). The
+ * system call table isn't even exported any more, and
+ * on some kernels it's read only. We need to
+ * know what a call returned and how long it took, so
+ * they are return probes (kretprobes): the kernel calls
+ * hook_entry when the function is entered, and
+ * hook_return when it returns, with a struct hook_call
+ * of our own for each call in progress to carry things
+ * from one to the other. Nobody else's hooks are
+ * touched, and removing the probes is always safe.
+ *
+ * Each system call has an entry in Hooks, which says
+ * which of its arguments are the path and the two we
+ * report (-1 for none). Adding a system call is adding
+ * a line here, and a TRACE_SYS_ number and a name for
+ * it. A probe is only placed while the filter set turns
+ * its system call on, so the ones we don't trace cost
+ * nothing. */
+struct hook {
+  int path_arg;
+  int args[2];
+  int registered;
+  struct kretprobe probe;
+};
+
+
+static int hook_entry(struct kretprobe_instance *ri,
+                      struct pt_regs *regs);
+static int hook_return(struct kretprobe_instance *ri,
+                       struct pt_regs *regs);
+
+
+#define HOOK(symbol, path, arg0, arg1) {                 \
+  .path_arg = path,                                      \
+  .args = { arg0, arg1 },                                \
+  .probe = {                                             \
+    .kp = { .symbol_name = symbol },                     \
+    .entry_handler = hook_entry,                         \
+    .handler = hook_return,                              \
+    .data_size = sizeof(struct hook_call),               \
+  },                                                     \
+}
+
+static struct hook Hooks[TRACE_SYS_COUNT] = {
+  /* openat(dfd, filename, flags, mode) - the C library
+   * calls it for open and creat as well */
+  [TRACE_SYS_OPEN]   = HOOK(SYSCALL_SYMBOL("openat"), 1, 2, 3),
+  [TRACE_SYS_READ]   = HOOK(SYSCALL_SYMBOL("read"), -1, 0, 2),
+  [TRACE_SYS_WRITE]  = HOOK(SYSCALL_SYMBOL("write"), -1, 0, 2),
+  [TRACE_SYS_CLOSE]  = HOOK(SYSCALL_SYMBOL("close"), -1, 0, -1),
+  /* newfstatat(dfd, filename, statbuf, flags) - and
+   * that's what it calls for stat */
+  [TRACE_SYS_STAT]   = HOOK(SYSCALL_SYMBOL("newfstatat"), 1, -1, -1),
+  [TRACE_SYS_EXECVE] = HOOK(SYSCALL_SYMBOL("execve"), 0, -1, -1),
+};
+
+
+/* How many calls of each function we can follow at
+ * once. If more are in progress, the rest aren't
+ * recorded, and cleanup_module says how many. */
+static int maxactive = 128;
+
+module_param(maxactive, int, 0);
+
+
+
+/* Which system call a probe is for */
+static inline int hook_syscall(struct kretprobe_instance *ri)
+{
+  struct hook *hook = container_of(get_kretprobe(ri),
+                                   struct hook, probe);
+
+  return hook - Hooks;
+}
+
+
+/* A traced function was entered. Returning non-zero
+ * tells the kernel not to bother with the return - for
+ * the calls we don't record, and for all of them when
+ * we aggregate and don't keep histograms, since then
+ * we need neither the return value nor the time. */
+static int hook_entry(struct kretprobe_instance *ri,
+                      struct pt_regs *regs)
+{
+  struct hook_call *call = (struct hook_call *) ri->data;
+  int sys = hook_syscall(ri);
+  struct hook *hook = &Hooks[sys];
+  struct filter_set *filter;
+  unsigned long args[6];
+  int skip = 1, i;
+
+  /* Check if this is somebody we're spying on */
+  rcu_read_lock();
+  filter = rcu_dereference(Filter);
+  if (!(filter->syscalls & (1UL << sys)) || !filter_ids(filter))
+    goto out;
+
+  /* The arguments of the system call, which are not the
+   * probed function's own where there are syscall
+   * wrappers */
+  syscall_probe_args(regs, args);
+
+  call->path_len = 0;
+  call->path_flags = 0;
+  call->path[0] = '\0';
+  if (hook->path_arg >= 0) {
+    call->path_len =
+      copy_path(call->path,
+                (const char __user *) args[hook->path_arg],
+                &call->path_flags);
+    if (filter->prefixes &&
+        ((call->path_flags & TRACE_PATH_FAULT) ||
+         !trie_match(filter, call->path)))
+      goto out;
+  }
+
+  if (aggregate) {
+    /* There's nothing to count a name we couldn't get */
+    if (!(call->path_flags & TRACE_PATH_FAULT))
+      agg_count(sys, CURRENT_UID(), call->path,
+                call->path_len);
+    if (!histograms)
+      goto out;
+  }
+
+  call->record = !aggregate;
+  for (i = 0; i < 2; i++)
+    call->args[i] = hook->args[i] >= 0 ?
+      args[hook->args[i]] : 0;
+  call->time = ktime_get_ns();
+  skip = 0;
+
+out:
+  rcu_read_unlock();
+  return skip;
+}
+
+
+/* A call hook_entry let through returned */
+static int hook_return(struct kretprobe_instance *ri,
+                       struct pt_regs *regs)
+{
+  struct hook_call *call = (struct hook_call *) ri->data;
+  int sys = hook_syscall(ri);
+  u64 latency = ktime_get_ns() - call->time;
+
+  if (histograms)
+    lat_count(sys, CURRENT_UID(), latency);
+
+  if (call->record)
+    record_event(sys, call, regs_return_value(regs), latency);
+
+  return 0;
+}
+
+
+/* Place the probes for the system calls in syscalls,
+ * and remove the others. Called with Filter_Lock held,
+ * which keeps two of us from doing it at once. A probe
+ * which can't be placed (the kernel may not have the
+ * function) is reported, and its system call is simply
+ * not traced. */
+static void sync_hooks(unsigned long syscalls)
+{
+  struct hook *hook;
+  int sys, ret;
+
+  for (sys = 0; sys < TRACE_SYS_COUNT; sys++) {
+    hook = &Hooks[sys];
+
+    if ((syscalls & (1UL << sys)) && !hook->registered) {
+      /* register_kretprobe fills these in, and
+       * refuses a probe which has them already */
+      hook->probe.kp.addr = NULL;
+      hook->probe.kp.flags = 0;
+      hook->probe.maxactive = maxactive;
+
+      ret = register_kretprobe(&hook->probe);
+      if (ret < 0)
+        printk("Can't place a probe on %s: %d\n",
+               hook->probe.kp.symbol_name, ret);
+      else
+        hook->registered = 1;
+    } else if (!(syscalls & (1UL << sys)) && hook->registered) {
+      /* This waits until nobody is in our handlers for
+       * the probe any more */
+      unregister_kretprobe(&hook->probe);
+      hook->registered = 0;
+    }
+  }
+}
+
+
+
+/* The device ****************************************** */
+
+
+/* Are there events in any of the rings? */
+static int events_pending(void)
+{
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    if (per_cpu(Rings, cpu)->head != per_cpu(Rings, cpu)->tail)
+      return 1;
+
+  return 0;
+}
+
+
+/* Copy up to count events from the rings to the
+ * reader's buffer. The events of one ring which are
+ * next to each other are copied together, so a full
+ * ring takes at most two copies. Returns the number of
+ * events copied, or -EFAULT if the first copy failed -
+ * once we've taken events out of the rings, the reader
+ * has to hear about them. */
+static ssize_t drain_rings(char __user *buffer,
+                           size_t count)
+{
+  struct trace_ring *ring;
+  unsigned int head, chunk;
+  size_t copied = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    ring = per_cpu(Rings, cpu);
+    head = ring->head;
+
+    /* Don't look at an event before we've seen the
+     * head which covers it */
+    smp_rmb();
+
+    while (ring->tail != head && copied < count) {
+      /* Up to the head, the end of the ring or as much
+       * as the reader wants, whatever comes first */
+      chunk = head - ring->tail;
+      if (chunk > RING_EVENTS - RING_SLOT(ring->tail))
+        chunk = RING_EVENTS - RING_SLOT(ring->tail);
+      if (chunk > count - copied)
+        chunk = count - copied;
+
+      if (copy_to_user(buffer +
+                         copied * sizeof(struct trace_event),
+                       &ring->events[RING_SLOT(ring->tail)],
+                       chunk * sizeof(struct trace_event)))
+        return copied ? copied : -EFAULT;
+
+      /* We must be done with the slots before the probe
+       * may reuse them */
+      smp_mb();
+      ring->tail += chunk;
+      copied += chunk;
+    }
+  }
+
+  return copied;
+}
+
+
+/* This function is called whenever a process reads
+ * from our device. It gets as many whole events as fit
+ * in its buffer, and sleeps if there are none (unless
+ * the device was opened with O_NONBLOCK). */
+static ssize_t trace_read(struct file *file,
+                          char __user *buffer,
+                          size_t length,
+                          loff_t *offset)
+{
+  size_t count = length / sizeof(struct trace_event);
+  ssize_t copied;
+
+  /* We never return part of an event */
+  if (count == 0)
+    return -EINVAL;
+
+  if (mutex_lock_interruptible(&Reader_Lock))
+    return -ERESTARTSYS;
+
+  while ((copied = drain_rings(buffer, count)) == 0) {
+    mutex_unlock(&Reader_Lock);
+
+    if (file->f_flags & O_NONBLOCK)
+      return -EAGAIN;
+
+    if (wait_event_interruptible(Trace_WaitQ,
+                                 events_pending()))
+      return -ERESTARTSYS;
+
+    if (mutex_lock_interruptible(&Reader_Lock))
+      return -ERESTARTSYS;
+  }
+
+  mutex_unlock(&Reader_Lock);
+
+  if (copied < 0)
+    return copied;
+
+  return copied * sizeof(struct trace_event);
+}
+
+
+static const struct file_operations Trace_Fops = {
+  .owner = THIS_MODULE,
+  .read = trace_read,
+};
+
+
+/* Free the rings and histogram tables we managed to
+ * allocate */
+static void free_rings(void)
+{
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    vfree(per_cpu(Rings, cpu));
+    per_cpu(Rings, cpu) = NULL;
+    vfree(per_cpu(Lat_Tables, cpu));
+    per_cpu(Lat_Tables, cpu) = NULL;
+  }
+}
+
+
+
+/* Initialize the module - place the probes */
+int init_module(void)
+{
+  int ret, cpu;
+  char text[32];
+
+  /* Start out with a filter which has the uid we were
+   * given */
+  sprintf(text, "uid %d\n", uid);
+  Filter = make_filter(text, strlen(text), &ret);
+  if (Filter == NULL)
+    return ret;
+
+  /* Every CPU which may ever run the probe needs a ring
+   * and a histogram table before the probe is placed */
+  for_each_possible_cpu(cpu) {
+    per_cpu(Rings, cpu) = vmalloc(sizeof(struct trace_ring));
+    per_cpu(Lat_Tables, cpu) = vmalloc(sizeof(struct lat_table));
+    if (per_cpu(Rings, cpu) == NULL ||
+        per_cpu(Lat_Tables, cpu) == NULL) {
+      free_rings();
+      free_filter(Filter);
+      return -ENOMEM;
+    }
+    memset(per_cpu(Rings, cpu), 0, sizeof(struct trace_ring));
+    memset(per_cpu(Lat_Tables, cpu), 0, sizeof(struct lat_table));
+  }
+
+  Major = register_chrdev(0, TRACE_DEVICE_NAME,
+                          &Trace_Fops);
+  if (Major < 0) {
+    printk("Registering the device failed with %d\n",
+           Major);
+    free_rings();
+    free_filter(Filter);
+    return Major;
+  }
+
+  if (proc_create("sys_trace_filter", S_IFREG | 0600, NULL,
+                  &Filter_Fops) == NULL) {
+    unregister_chrdev(Major, TRACE_DEVICE_NAME);
+    free_rings();
+    free_filter(Filter);
+    return -ENOMEM;
+  }
+
+  if (histograms &&
+      proc_create("sys_trace_latency", S_IFREG | 0600, NULL,
+                  &Latency_Fops) == NULL) {
+    remove_proc_entry("sys_trace_filter", NULL);
+    unregister_chrdev(Major, TRACE_DEVICE_NAME);
+    free_rings();
+    free_filter(Filter);
+    return -ENOMEM;
+  }
+
+  if (aggregate) {
+    ret = agg_alloc();
+    if (ret == 0 &&
+        proc_create("sys_trace_top", S_IFREG | 0444, NULL,
+                    &Top_Fops) == NULL)
+      ret = -ENOMEM;
+
+    if (ret < 0) {
+      agg_free();
+      if (histograms)
+        remove_proc_entry("sys_trace_latency", NULL);
+      remove_proc_entry("sys_trace_filter", NULL);
+      unregister_chrdev(Major, TRACE_DEVICE_NAME);
+      free_rings();
+      free_filter(Filter);
+      return ret;
+    }
+  }
+
+  /* Only open, until somebody writes a filter set
+   * with other system calls */
+  mutex_lock(&Filter_Lock);
+  sync_hooks(Filter->syscalls);
+  mutex_unlock(&Filter_Lock);
+
+  printk("Spying on UID:%d\n", uid);
+  printk("Read the events from a device file made with\n");
+  printk("mknod %s c %d 0\n", TRACE_DEVICE_NAME, Major);
+
+  return 0;
+}
+
+
+/* Cleanup - remove the probes */
+void cleanup_module(void)
+{
+  unsigned long drops = 0;
+  int cpu, sys;
+
+  /* Nobody can write a filter set any more, so nobody
+   * will place a probe behind our back */
+  remove_proc_entry("sys_trace_filter", NULL);
+
+  /* This waits until nobody is in our handlers any
+   * more, so it's safe to unload the module after it */
+  for (sys = 0; sys < TRACE_SYS_COUNT; sys++) {
+    if (!Hooks[sys].registered)
+      continue;
+    unregister_kretprobe(&Hooks[sys].probe);
+    if (Hooks[sys].probe.nmissed)
+      printk("%d calls of %s were missed, raise "
+             "maxactive\n", Hooks[sys].probe.nmissed,
+             Syscall_Names[sys]);
+  }
+
+  if (aggregate) {
+    remove_proc_entry("sys_trace_top", NULL);
+    agg_free();
+  }
+
+  if (histograms)
+    remove_proc_entry("sys_trace_latency", NULL);
+
+  /* The device holds a reference to the module while
+   * it's open, so nobody is reading now either */
+  unregister_chrdev(Major, TRACE_DEVICE_NAME);
+
+  for_each_possible_cpu(cpu)
+    drops += per_cpu(Rings, cpu)->drops;
+  if (drops)
+    printk("%lu events were lost, the reader didn't "
+           "keep up\n", drops);
+
+  free_rings();
+  free_filter(Filter);
+}
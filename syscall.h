@@ -0,0 +1,88 @@
+/*  syscall.h - the header file with the event format.
+ *
+ *  The declarations here have to be in a header file,
+ *  because they need to be known both to the kernel
+ *  module (in syscall.c) and the process reading the
+ *  events.
+ */
+
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include <linux/types.h>
+
+
+
+/* The name of the device file the events are read
+ * from. The major device number is given out
+ * dynamically - syscall.c prints it when it's
+ * insmod'ed. */
+#define TRACE_DEVICE_NAME "sys_trace"
+
+
+/* The system calls we can trace. These are the values
+ * of an event's syscall field. In the filter file, they
+ * are given by name (the name in the comment). */
+#define TRACE_SYS_OPEN    0   /* open - really openat,
+                               * which the C library
+                               * calls for open and
+                               * creat too */
+#define TRACE_SYS_READ    1   /* read */
+#define TRACE_SYS_WRITE   2   /* write */
+#define TRACE_SYS_CLOSE   3   /* close */
+#define TRACE_SYS_STAT    4   /* stat - really
+                               * newfstatat, which is
+                               * what stat calls */
+#define TRACE_SYS_EXECVE  5   /* execve */
+
+#define TRACE_SYS_COUNT   6
+
+
+/* The longest path an event can hold, including the
+ * terminating NULL. It makes an event exactly 256
+ * bytes long. */
+#define TRACE_PATH_LEN 200
+
+
+/* One system call, as it is read from the device. A
+ * read always returns whole events, as many as fit in
+ * the buffer it was given. */
+struct trace_event {
+  __u64 time;        /* When the call was made -
+                      * nanoseconds, monotonic clock */
+  __u64 latency;     /* Nanoseconds from the call to
+                      * its return */
+  __s64 ret;         /* What the call returned */
+  __u64 args[2];     /* See below */
+  __u32 pid;         /* Process (thread group) ID */
+  __u32 uid;         /* User ID */
+  __u16 syscall;     /* TRACE_SYS_... */
+  __u16 path_len;    /* Length of path, without the
+                      * NULL */
+  __u16 path_flags;  /* See below */
+  __u16 reserved;
+  char path[TRACE_PATH_LEN];  /* The file name the call
+                               * got - open, stat and
+                               * execve only */
+};
+
+
+/* args, for each of the system calls:
+ *
+ * open   - the flags and the mode
+ * read   - the file descriptor and the count
+ * write  - the file descriptor and the count
+ * close  - the file descriptor
+ * stat   - nothing
+ * execve - nothing
+ */
+
+
+/* path_flags */
+#define TRACE_PATH_CUT   1  /* path is only the beginning
+                             * of the real one */
+#define TRACE_PATH_FAULT 2  /* The path wasn't in memory,
+                             * so path is empty */
+
+
+#endif